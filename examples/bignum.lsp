@@ -0,0 +1,36 @@
+(defun dbl (x k)
+  (if (= k 0)
+    x
+    (dbl (+ x x) (- k 1))))
+
+(defun pow2 (k) (dbl 1 k))
+
+(defun neg (x) (- 0 x))
+
+(defun down (x d k)
+  (if (= k 0)
+    x
+    (down (- x d) d (- k 1))))
+
+(defun same (b) (= (- (+ b b) b) b))
+
+(defun warm (n acc)
+  (if (= n 0)
+    acc
+    (warm (- n 1) (+ acc (+ (pow2 20) (+ (neg (down 0 3 10)) (same n)))))))
+
+(warm 2000 0)
+(pow2 61)
+(pow2 62)
+(pow2 70)
+(neg (pow2 70))
+(+ 4611686018427387903 1)
+(- (neg 4611686018427387903) 2)
+(down 0 4611686018427387903 3)
+(down (pow2 70) (pow2 68) 4)
+(same (pow2 70))
+(same (neg (pow2 70)))
+(- (pow2 70) (- (pow2 70) 5))
+(+ (- (pow2 70) (- (pow2 70) 5)) 1)
+(+ (neg (pow2 64)) (pow2 64))
+(dbl (pow2 70) 60)
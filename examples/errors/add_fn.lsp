@@ -0,0 +1,11 @@
+(defun inc (x) (+ x 1))
+
+(defun f (g k) (+ g k))
+
+(defun warm (n)
+  (if (= n 0)
+    0
+    (- (f n 1) (warm (- n 1)))))
+
+(warm 2000)
+(f inc 1)
@@ -0,0 +1,33 @@
+(defun fibi (a b n)
+  (if (= n 0)
+    a
+    (fibi b (+ a b) (- n 1))))
+
+(defun swap (a b n)
+  (if (= n 0)
+    (- a b)
+    (swap b a (- n 1))))
+
+(defun sub3 (c a b) (- c (+ a b)))
+
+(defun rotate (a b c) (sub3 c a b))
+
+(defun step (x) (+ x 3))
+
+(defun count (acc n)
+  (if (= n 0)
+    acc
+    (count (+ acc (step n)) (- n 1))))
+
+(defun warm (n acc)
+  (if (= n 0)
+    acc
+    (warm (- n 1) (+ acc (+ (fibi 0 1 30) (+ (swap n 1 7) (rotate 1 2 n)))))))
+
+(warm 1000 0)
+(fibi 0 1 90)
+(fibi 0 1 100)
+(swap 10 3 4)
+(swap 10 3 5)
+(rotate 1 2 10)
+(count 0 3000000)
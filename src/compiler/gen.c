@@ -126,7 +126,14 @@ static int find_symbol(LspState state[static 1], char *sym, uint8_t res[static 1
         return -1;
 }
 
-static int compile_sexpr(LspState state[static 1], mpc_ast_t *ast, uint8_t res[static 1]);
+/**
+ * Compiles the expression `ast`, and stores the register its value ends up in
+ * in `res`.
+ *
+ * \param `tail` Whether the value of the expression is what the current
+ * function returns.
+ */
+static int compile_sexpr(LspState state[static 1], mpc_ast_t *ast, bool tail, uint8_t res[static 1]);
 
 static int compile_two_op_expr(LspState state[static 1],
                                mpc_ast_t *ast,
@@ -146,7 +153,7 @@ static int compile_two_op_expr(LspState state[static 1],
         uint8_t out_regs[2] = {0, 0};
         for (int i = 2; i < ast->children_num - 1; ++i) {
                 mpc_ast_t *child = ast->children[i];
-                if (compile_sexpr(state, child, &out_regs[i-2]) != 0) {
+                if (compile_sexpr(state, child, false, &out_regs[i-2]) != 0) {
                         return -1;
                 }
         }
@@ -199,10 +206,13 @@ static int compile_defun(LspState state[static 1],
         }
         uint8_t last_res = 0;
         for (int i = sindex + 3; i < ast->children_num - 1; ++i) {
-                if (compile_sexpr(state, ast->children[i], &last_res) != 0) {
+                bool tail = i == ast->children_num - 2;
+                if (compile_sexpr(state, ast->children[i], tail, &last_res) != 0) {
                         return -1;
                 }
         }
+        // nested functions may have moved the function
+        f = &state->funcs[index];
         uint8_t ret_args[3] = {last_res, 0, 0};
         LspInstr ret = lsp_new_instr(OP_RET, ret_args);
         cvector_push_back(f->instrs, ret);
@@ -219,13 +229,114 @@ static int compile_defun(LspState state[static 1],
         return 0;
 }
 
+/**
+ * Moves `srcs` into the `n` registers starting at `dst`, as if all moves
+ * happened at once: a register is only overwritten once no other move needs
+ * its value anymore. Moves that depend on each other in a cycle go through a
+ * new register.
+ */
+static void emit_moves(LspFunc f[static 1], uint8_t dst, uint8_t srcs[static 1], uint8_t n) {
+        bool done[256];
+        uint8_t left = 0;
+        for (uint8_t i = 0; i < n; ++i) {
+                done[i] = srcs[i] == dst + i;
+                left += !done[i];
+        }
+        while (left > 0) {
+                bool moved = false;
+                for (uint8_t i = 0; i < n; ++i) {
+                        bool needed = false;
+                        for (uint8_t j = 0; j < n && !done[i]; ++j) {
+                                needed |= !done[j] && j != i && srcs[j] == dst + i;
+                        }
+                        if (done[i] || needed) {
+                                continue;
+                        }
+                        uint8_t args[3] = {dst + i, srcs[i], 0};
+                        cvector_push_back(f->instrs, lsp_new_instr(OP_MOV, args));
+                        done[i] = true;
+                        left--;
+                        moved = true;
+                }
+                if (moved) {
+                        continue;
+                }
+                // only cycles are left, so one of their registers is saved
+                // elsewhere, which breaks its cycle
+                uint8_t i = 0;
+                while (done[i]) {
+                        i++;
+                }
+                uint8_t saved = f->regs_in_use++;
+                uint8_t args[3] = {saved, dst + i, 0};
+                cvector_push_back(f->instrs, lsp_new_instr(OP_MOV, args));
+                for (uint8_t j = 0; j < n; ++j) {
+                        if (!done[j] && srcs[j] == dst + i) {
+                                srcs[j] = saved;
+                        }
+                }
+        }
+}
+
+/** Whether calling `sym` from the current function calls the function itself. */
+static bool is_self_call(LspState state[static 1], const char *sym) {
+        LspFunc *f = &state->funcs[state->curr_func];
+        if (state->curr_func == 0) {
+                return false;
+        }
+        // the same lookup as `find_symbol`
+        for (size_t i = 0; i < cvector_size(f->symbols); ++i) {
+                if (strcmp(f->symbols[i].name, sym) == 0) {
+                        return false;
+                }
+        }
+        for (size_t i = 1; i < cvector_size(state->funcs); ++i) {
+                if (strcmp(sym, state->funcs[i].name) == 0) {
+                        return i == state->curr_func;
+                }
+        }
+        return false;
+}
+
+/**
+ * Compiles a call of the current function by itself, whose result is also the
+ * result of the function: the arguments become the new parameters, and the
+ * function starts over with a backward jump. This is how programs loop, without
+ * growing the stack.
+ */
+static int compile_tail_call(LspState state[static 1],
+                             mpc_ast_t *ast,
+                             size_t sindex,
+                             uint8_t res[static 1]) {
+        uint8_t regs[256];
+        for (int i = sindex + 1; i < ast->children_num - 1; ++i) {
+                if (compile_sexpr(state, ast->children[i], false, &regs[i-sindex-1]) != 0) {
+                        return -1;
+                }
+        }
+        LspFunc *f = &state->funcs[state->curr_func];
+        emit_moves(f, 0, regs, f->num_of_params);
+        size_t pc = cvector_size(f->instrs);
+        assert(pc <= -INT16_MIN);
+        cvector_push_back(f->instrs, lsp_new_instr_l(OP_JMP, 0, (uint16_t)-(int32_t)pc));
+        // nothing runs after the jump, but the caller still wants a register
+        *res = f->regs_in_use++;
+        return 0;
+}
+
 static int compile_call(LspState state[static 1],
                         mpc_ast_t *ast,
                         size_t sindex,
+                        bool tail,
                         uint8_t res[static 1]) {
         // find the symbol that we are calling
         mpc_ast_t *symbol = ast->children[sindex];
         LspFunc *f = &state->funcs[state->curr_func];
+        if (tail
+            && ast->children_num - sindex - 2 == f->num_of_params
+            && is_self_call(state, symbol->contents)) {
+                return compile_tail_call(state, ast, sindex, res);
+        }
         uint8_t sym_reg = f->regs_in_use++;
         if (find_symbol(state, symbol->contents, &sym_reg) != 0) {
                 return -1;
@@ -242,20 +353,18 @@ static int compile_call(LspState state[static 1],
         uint8_t total_args = ast->children_num - sindex - 2;
         uint8_t regs[256];
         for (int i = sindex + 1; i < ast->children_num - 1; ++i) {
-                if (compile_sexpr(state, ast->children[i], &regs[i-sindex-1]) != 0) {
+                if (compile_sexpr(state, ast->children[i], false, &regs[i-sindex-1]) != 0) {
                         return -1;
                 }
         }
 
         // move each argument into a new register, such that all arguments are
         // in consecutive registers, and start at `sym_reg + 1`
-        for (uint8_t i = 0; i < total_args; ++i) {
-                if (sym_reg + i + 1 != regs[i]) {
-                        uint8_t args[3] = {sym_reg + i + 1, regs[i], 0};
-                        LspInstr instr = lsp_new_instr(OP_MOV, args);
-                        cvector_push_back(f->instrs, instr);
-                }
+        f = &state->funcs[state->curr_func];
+        if (f->regs_in_use < sym_reg + 1 + total_args) {
+                f->regs_in_use = sym_reg + 1 + total_args;
         }
+        emit_moves(f, sym_reg + 1, regs, total_args);
 
         // prepare the call instruction
         uint8_t out_reg = f->regs_in_use++;
@@ -269,6 +378,7 @@ static int compile_call(LspState state[static 1],
 static int compile_if(LspState state[static 1],
                       mpc_ast_t *ast,
                       size_t sindex,
+                      bool tail,
                       uint8_t res[static 1]) {
         if (ast->children_num != 6) {
                 printf("If statements must have an 3 operands.\n");
@@ -277,7 +387,7 @@ static int compile_if(LspState state[static 1],
 
         // compile the condition
         uint8_t condition = 0;
-        if (compile_sexpr(state, ast->children[sindex + 1], &condition) != 0) {
+        if (compile_sexpr(state, ast->children[sindex + 1], false, &condition) != 0) {
                 return -1;
         }
 
@@ -289,7 +399,7 @@ static int compile_if(LspState state[static 1],
 
         uint8_t out_reg = f->regs_in_use++;
         uint8_t true_br = 0;
-        if (compile_sexpr(state, ast->children[sindex + 2], &true_br) != 0) {
+        if (compile_sexpr(state, ast->children[sindex + 2], tail, &true_br) != 0) {
                 return -1;
         }
         uint8_t mov_args[3] = {out_reg, true_br, 0};
@@ -298,7 +408,7 @@ static int compile_if(LspState state[static 1],
         size_t else_jmp_index = cvector_size(f->instrs) - 1;
 
         uint8_t false_br = 0;
-        if (compile_sexpr(state, ast->children[sindex + 3], &false_br) != 0) {
+        if (compile_sexpr(state, ast->children[sindex + 3], tail, &false_br) != 0) {
                 return -1;
         }
         uint8_t mov_args2[3] = {out_reg, false_br, 0};
@@ -313,7 +423,7 @@ static int compile_if(LspState state[static 1],
         return 0;
 }
 
-static int compile_sexpr(LspState state[static 1], mpc_ast_t *ast, uint8_t res[static 1]) {
+static int compile_sexpr(LspState state[static 1], mpc_ast_t *ast, bool tail, uint8_t res[static 1]) {
         printf("-----\n");
         mpc_ast_print(ast);
         if (ast->children_num == 0) {
@@ -343,9 +453,9 @@ static int compile_sexpr(LspState state[static 1], mpc_ast_t *ast, uint8_t res[s
         } else if (strcmp(symbol->contents, "defun") == 0) {
                 return compile_defun(state, ast, sindex, res);
         } else if (strcmp(symbol->contents, "if") == 0) {
-                return compile_if(state, ast, sindex, res);
+                return compile_if(state, ast, sindex, tail, res);
         } else {
-                return compile_call(state, ast, sindex, res);
+                return compile_call(state, ast, sindex, tail, res);
         }
         return -1;
 }
@@ -358,11 +468,14 @@ LspState lsp_compile(mpc_ast_t *ast) {
         uint8_t reg = 0;
         cvector_push_back(s.funcs, lsp_new_func("__main__"));
         for (int i = 1; i < ast->children_num - 1; ++i) {
-                if (compile_sexpr(&s, ast->children[i], &reg) != 0) {
+                if (compile_sexpr(&s, ast->children[i], false, &reg) != 0) {
                         printf("Failed...\n");
                         break;
                 }
         }
+        // the main function returns its last result, like any other function
+        uint8_t ret_args[3] = {reg, 0, 0};
+        cvector_push_back(s.funcs[0].instrs, lsp_new_instr(OP_RET, ret_args));
         for (size_t i = 0; i < cvector_size(s.funcs); ++i) {
                 printf("Func %ld:\n", i);
                 cvector_vector_type(LspInstr) instrs = s.funcs[i].instrs;
@@ -20,6 +20,10 @@ uint16_t lsp_get_long_arg(LspInstr instr) {
         return instr & 0xffff;
 }
 
+int16_t lsp_get_offset(LspInstr instr) {
+        return (int16_t)lsp_get_long_arg(instr);
+}
+
 LspInstr lsp_new_instr(LspOpcode opcode, uint8_t vals[static 3]) {
         LspInstr instr = vals[2];
         instr += ((uint32_t) opcode << 24) +
@@ -14,12 +14,14 @@ typedef enum {
         OP_EQ = 5,
         // if R[A] == 1, then skip next instr
         OP_TEST = 6,
-        // pc += long_arg
+        // pc += long_arg, which is signed
         OP_JMP = 7,
         OP_SUB = 8,
         OP_RET = 9,
 } LspOpcode;
 
+#define LSP_NUM_OPCODES (OP_RET + 1)
+
 
 typedef uint32_t LspInstr;
 
@@ -33,6 +35,9 @@ uint8_t lsp_get_arg3(LspInstr instr);
 
 uint16_t lsp_get_long_arg(LspInstr instr);
 
+/** The offset a JMP adds to the pc. */
+int16_t lsp_get_offset(LspInstr instr);
+
 LspInstr lsp_new_instr(LspOpcode opcode, uint8_t vals[static 3]);
 
 LspInstr lsp_new_instr_l(LspOpcode opcode, uint8_t reg, uint16_t big);
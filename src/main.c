@@ -1,22 +1,81 @@
 #include <vm/jit.h>
 #include <compiler/gen.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 int main(int argc, char **argv) {
+        const char *path = NULL;
+        bool stats = false;
+        LspJitOpts opts = lsp_jit_default_opts();
+        opts.cache_dir = getenv("LSP_JIT_CACHE");
+        for (int i = 1; i < argc; ++i) {
+                if (strcmp(argv[i], "--stats") == 0) {
+                        stats = true;
+                } else if (strcmp(argv[i], "--no-jit") == 0) {
+                        opts.enabled = false;
+                } else if (strncmp(argv[i], "--jit-opt=", 10) == 0) {
+                        int level = atoi(argv[i] + 10);
+                        if (level < 0 || level > 3) {
+                                printf("Invalid optimization level: %s.\n", argv[i] + 10);
+                                return 1;
+                        }
+                        opts.opt_level = level;
+                } else if (strcmp(argv[i], "--dump-ir") == 0) {
+                        opts.dump_ir = true;
+                } else if (strcmp(argv[i], "--jit-tier=baseline") == 0) {
+                        opts.tier = LSP_TIER_BASELINE;
+                } else if (strcmp(argv[i], "--jit-tier=llvm") == 0) {
+                        opts.tier = LSP_TIER_LLVM;
+                } else if (strcmp(argv[i], "--sync-jit") == 0) {
+                        opts.background = false;
+                } else if (strncmp(argv[i], "--jit-cache=", 12) == 0) {
+                        opts.cache_dir = argv[i] + 12;
+                } else if (strncmp(argv[i], "--jit-cache-limit=", 18) == 0) {
+                        opts.cache_limit = strtoull(argv[i] + 18, NULL, 10);
+                } else if (strncmp(argv[i], "--jit-baseline-at=", 18) == 0) {
+                        opts.tiering.baseline_at = strtoul(argv[i] + 18, NULL, 10);
+                } else if (strncmp(argv[i], "--jit-optimize-at=", 18) == 0) {
+                        opts.tiering.optimize_at = strtoul(argv[i] + 18, NULL, 10);
+                } else if (strncmp(argv[i], "--jit-stable-traces=", 20) == 0) {
+                        opts.tiering.stable_traces = strtoul(argv[i] + 20, NULL, 10);
+                } else if (strncmp(argv[i], "--jit-min-work=", 15) == 0) {
+                        opts.tiering.min_work = strtoul(argv[i] + 15, NULL, 10);
+                } else if (strncmp(argv[i], "--jit-recompile-after=", 22) == 0) {
+                        opts.tiering.recompile_after = strtoul(argv[i] + 22, NULL, 10);
+                } else {
+                        path = argv[i];
+                }
+        }
         LspLang lang = lsp_create_lang();
         mpc_result_t r;
-        if (argc > 1) {
-                if (mpc_parse_contents(argv[1], lang.lispy, &r)) {
+        if (path) {
+                if (mpc_parse_contents(path, lang.lispy, &r)) {
                         LspState s = lsp_compile(r.output);
-                        LspJit jit = lsp_jit_new(&s);
+                        LspJit jit = lsp_jit_new(&s, opts);
+                        lsp_jit_load_cache(&jit);
                         LspVm *vm = &jit.vm;
+                        double start = lsp_now();
                         lsp_interpret(&jit);
-                        for (size_t i = 0; i < cvector_size(vm->regs); ++i) {
+                        double elapsed = lsp_now() - start;
+                        // nothing is compiled once the program is done
+                        lsp_jit_stop_compiler(&jit);
+                        for (size_t i = 0; i < vm->regs_top; ++i) {
                                 LspValue v = vm->regs[i];
                                 if (v) {
                                         printf("Reg[%ld]: ", i);
                                         lsp_print_val(v);
                                 }
                         }
+                        if (stats) {
+                                printf("Interpreter: %ld instructions in %.3fs (%.0f instructions/s).\n",
+                                       vm->executed,
+                                       elapsed,
+                                       vm->executed / elapsed);
+                                lsp_arena_print_stats(&vm->arena);
+                                lsp_gc_print_stats(&vm->gc);
+                                lsp_jit_print_stats(&jit);
+                        }
                         lsp_jit_free(&jit);
                         lsp_cleanup_state(&s);
                         mpc_ast_delete(r.output);
@@ -0,0 +1,93 @@
+#include "arena.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LSP_CHUNK_SIZE 4096
+#define LSP_ARENA_ALIGN 16
+
+static LspArenaChunk* new_chunk(LspArenaChunk *prev, size_t size) {
+        LspArenaChunk *c = lsp_malloc(sizeof(LspArenaChunk) + size);
+        c->prev = prev;
+        c->size = size;
+        c->used = 0;
+        return c;
+}
+
+LspArena lsp_arena_new() {
+        LspArena arena = {
+                .head = new_chunk(NULL, LSP_CHUNK_SIZE),
+                .spare = NULL,
+                .allocated = 0,
+                .released = 0,
+                .in_use = 0,
+        };
+        return arena;
+}
+
+void* lsp_arena_alloc(LspArena self[static 1], size_t s) {
+        s = (s + LSP_ARENA_ALIGN - 1) & ~(size_t)(LSP_ARENA_ALIGN - 1);
+        LspArenaChunk *c = self->head;
+        if (c->size - c->used < s) {
+                if (self->spare && self->spare->size >= s) {
+                        c = self->spare;
+                        self->spare = NULL;
+                        c->prev = self->head;
+                        c->used = 0;
+                } else {
+                        size_t size = s > LSP_CHUNK_SIZE ? s : LSP_CHUNK_SIZE;
+                        c = new_chunk(self->head, size);
+                }
+                self->head = c;
+        }
+        void *m = c->data + c->used;
+        c->used += s;
+        self->allocated += s;
+        self->in_use += s;
+        return m;
+}
+
+LspArenaMark lsp_arena_mark(const LspArena self[static 1]) {
+        LspArenaMark mark = {
+                .chunk = self->head,
+                .used = self->head->used,
+        };
+        return mark;
+}
+
+void lsp_arena_release(LspArena self[static 1], LspArenaMark mark) {
+        size_t released = 0;
+        while (self->head != mark.chunk) {
+                LspArenaChunk *c = self->head;
+                self->head = c->prev;
+                released += c->used;
+                if (!self->spare || self->spare->size < c->size) {
+                        free(self->spare);
+                        self->spare = c;
+                } else {
+                        free(c);
+                }
+        }
+        released += self->head->used - mark.used;
+        self->head->used = mark.used;
+        self->released += released;
+        self->in_use -= released;
+}
+
+void lsp_arena_print_stats(const LspArena self[static 1]) {
+        printf("Arena: %ld bytes allocated, %ld bytes released at frame exit, %ld bytes retained.\n",
+               self->allocated,
+               self->released,
+               self->in_use);
+}
+
+void lsp_arena_free(LspArena self[static 1]) {
+        while (self->head) {
+                LspArenaChunk *c = self->head;
+                self->head = c->prev;
+                free(c);
+        }
+        free(self->spare);
+        self->spare = NULL;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** A block of memory values are bump-allocated from. */
+typedef struct LspArenaChunk {
+        struct LspArenaChunk *prev;
+        size_t size;
+        size_t used;
+        _Alignas(16) uint8_t data[];
+} LspArenaChunk;
+
+/** A position in the arena, everything allocated after it can be released at once. */
+typedef struct LspArenaMark {
+        LspArenaChunk *chunk;
+        size_t used;
+} LspArenaMark;
+
+/**
+ * A region allocator for boxed values. Each stack frame takes a mark when it
+ * is pushed, and releases everything allocated after it when it pops.
+ */
+typedef struct LspArena {
+        LspArenaChunk *head;
+        /* A released chunk kept around, so that frames which keep crossing
+        a chunk boundary don't hit malloc every time. */
+        LspArenaChunk *spare;
+        /* Total number of bytes handed out. */
+        size_t allocated;
+        /* Number of bytes given back when frames were popped. */
+        size_t released;
+        /* Number of bytes that are currently allocated. */
+        size_t in_use;
+} LspArena;
+
+LspArena lsp_arena_new();
+
+void* lsp_arena_alloc(LspArena self[static 1], size_t s);
+
+LspArenaMark lsp_arena_mark(const LspArena self[static 1]);
+
+void lsp_arena_release(LspArena self[static 1], LspArenaMark mark);
+
+void lsp_arena_print_stats(const LspArena self[static 1]);
+
+void lsp_arena_free(LspArena self[static 1]);
@@ -0,0 +1,524 @@
+#include "baseline.h"
+#include "jit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+LspBaseline lsp_baseline_new() {
+        LspBaseline baseline = {
+                .code = NULL,
+                .exits = NULL,
+                .compiled = 0,
+                .compile_time = 0,
+        };
+        return baseline;
+}
+
+bool lsp_baseline_supported() {
+#if defined(__x86_64__) && defined(__linux__)
+        return true;
+#else
+        return false;
+#endif
+}
+
+/*
+ * The native frame:
+ *
+ *   [rbp - 16 * (regs - r)]          register r, as an LspNativeValue
+ *   [rbp - 16 * (regs + args)]       the arguments of calls, in order
+ *
+ * so that the registers are laid out the way side exits spill them.
+ *
+ * rax and rcx are the only scratch registers, besides the ones calls take.
+ */
+
+typedef cvector_vector_type(uint8_t) Buf;
+
+static void emit(Buf *buf, size_t n, const uint8_t bytes[static n]) {
+        for (size_t i = 0; i < n; ++i) {
+                cvector_push_back((*buf), bytes[i]);
+        }
+}
+
+static void emit_u32(Buf *buf, uint32_t v) {
+        for (size_t i = 0; i < 4; ++i) {
+                cvector_push_back((*buf), (v >> (i * 8)) & 0xff);
+        }
+}
+
+static void emit_u64(Buf *buf, uint64_t v) {
+        emit_u32(buf, v);
+        emit_u32(buf, v >> 32);
+}
+
+/** Where register `r` is, in a frame of `regs` registers. */
+static int32_t reg_disp(int32_t regs, uint8_t r) {
+        return -16 * (regs - (int32_t)r);
+}
+
+/** Where the tag of the LspNativeValue at `disp` is. */
+static int32_t tag_disp(int32_t disp) {
+        return disp + 8;
+}
+
+/** <op> <reg>, [rbp + disp], where `modrm_reg` is the reg field of ModRM. */
+static void emit_rbp(Buf *buf, uint8_t op, uint8_t modrm_reg, int32_t disp) {
+        uint8_t bytes[3] = { 0x48, op, 0x85 | (modrm_reg << 3) };
+        emit(buf, 3, bytes);
+        emit_u32(buf, disp);
+}
+
+/** mov rax, [rbp + disp] */
+static void load_rax(Buf *buf, int32_t disp) {
+        emit_rbp(buf, 0x8b, 0, disp);
+}
+
+/** mov [rbp + disp], rax */
+static void store_rax(Buf *buf, int32_t disp) {
+        emit_rbp(buf, 0x89, 0, disp);
+}
+
+/** mov qword [rbp + disp], tag */
+static void store_tag(Buf *buf, int32_t disp, LspTag tag) {
+        emit_rbp(buf, 0xc7, 0, tag_disp(disp));
+        emit_u32(buf, tag);
+}
+
+/** mov <reg>, imm64, where `reg` is the register number. */
+static void mov_imm(Buf *buf, uint8_t reg, uint64_t imm) {
+        uint8_t bytes[2] = { reg < 8 ? 0x48 : 0x49, 0xb8 + (reg & 7) };
+        emit(buf, 2, bytes);
+        emit_u64(buf, imm);
+}
+
+/** Copies the LspNativeValue at `from` to `to`, through rax. */
+static void copy_value(Buf *buf, int32_t to, int32_t from) {
+        load_rax(buf, from);
+        store_rax(buf, to);
+        load_rax(buf, tag_disp(from));
+        store_rax(buf, tag_disp(to));
+}
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define R8 8
+
+/* Condition codes, for jcc. */
+#define CC_O 0x0
+#define CC_E 0x4
+#define CC_NE 0x5
+
+/** A rel32 jump, waiting for the address of the instruction it goes to. */
+typedef struct Fixup {
+        /* Where the rel32 is in the code. */
+        size_t at;
+        size_t target;
+} Fixup;
+
+/** Emits the opcode bytes of a jump, and returns where its rel32 goes. */
+static size_t emit_jump(Buf *buf, size_t n, const uint8_t opcode[static n]) {
+        emit(buf, n, opcode);
+        size_t at = cvector_size(*buf);
+        emit_u32(buf, 0);
+        return at;
+}
+
+static void patch_rel32(Buf buf, size_t at, size_t to) {
+        uint32_t rel = (uint32_t)((int64_t)to - (int64_t)(at + 4));
+        for (size_t i = 0; i < 4; ++i) {
+                buf[at + i] = (rel >> (i * 8)) & 0xff;
+        }
+}
+
+/** Calls the function in register `r2`, with the registers after it, up to
+`r3`, as arguments. */
+static void emit_call(Buf *buf,
+                      LspJit jit[static 1],
+                      int32_t regs,
+                      int32_t args_disp,
+                      uint8_t r1,
+                      uint8_t r2,
+                      uint8_t r3) {
+        for (size_t r = r2 + 1; r <= r3; ++r) {
+                copy_value(buf, args_disp + 16 * (int32_t)(r - r2 - 1), reg_disp(regs, r));
+        }
+        // mov rsi, [rbp + r2]
+        emit_rbp(buf, 0x8b, RSI, reg_disp(regs, r2));
+        // cmp qword [tag of r2], TAG_FN; jne slow
+        emit_rbp(buf, 0x83, 7, tag_disp(reg_disp(regs, r2)));
+        uint8_t fn_tag[1] = { TAG_FN };
+        emit(buf, 1, fn_tag);
+        uint8_t jne[2] = { 0x0f, 0x85 };
+        size_t not_fn = emit_jump(buf, 2, jne);
+        // cmp rsi, funcs; jae slow
+        uint8_t cmp[3] = { 0x48, 0x81, 0xfe };
+        emit(buf, 3, cmp);
+        emit_u32(buf, cvector_size(jit->entries));
+        uint8_t jae[2] = { 0x0f, 0x83 };
+        size_t oob = emit_jump(buf, 2, jae);
+        // mov rax, &stack_limit; cmp rsp, [rax]; jb slow
+        mov_imm(buf, RAX, (uint64_t)&jit->stack_limit);
+        uint8_t cmp_rsp[3] = { 0x48, 0x3b, 0x20 };
+        emit(buf, 3, cmp_rsp);
+        uint8_t jb[2] = { 0x0f, 0x82 };
+        size_t deep = emit_jump(buf, 2, jb);
+        // mov rax, [entries + rsi * 8]; test rax, rax; jz slow
+        mov_imm(buf, RAX, (uint64_t)jit->entries);
+        uint8_t load_entry[4] = { 0x48, 0x8b, 0x04, 0xf0 };
+        emit(buf, 4, load_entry);
+        uint8_t test[3] = { 0x48, 0x85, 0xc0 };
+        emit(buf, 3, test);
+        uint8_t jz[2] = { 0x0f, 0x84 };
+        size_t interpreted = emit_jump(buf, 2, jz);
+        // lea rdi, [args]; call rax; jmp done
+        emit_rbp(buf, 0x8d, RDI, args_disp);
+        uint8_t call_rax[2] = { 0xff, 0xd0 };
+        emit(buf, 2, call_rax);
+        uint8_t jmp[1] = { 0xe9 };
+        size_t done = emit_jump(buf, 1, jmp);
+
+        // slow: lsp_jit_call(jit, rsi, tag of r2, args, nargs)
+        patch_rel32(*buf, not_fn, cvector_size(*buf));
+        patch_rel32(*buf, oob, cvector_size(*buf));
+        patch_rel32(*buf, deep, cvector_size(*buf));
+        patch_rel32(*buf, interpreted, cvector_size(*buf));
+        mov_imm(buf, RDI, (uint64_t)jit);
+        emit_rbp(buf, 0x8b, RDX, tag_disp(reg_disp(regs, r2)));
+        emit_rbp(buf, 0x8d, RCX, args_disp);
+        mov_imm(buf, R8, r3 - r2);
+        mov_imm(buf, RAX, (uint64_t)lsp_jit_call);
+        emit(buf, 2, call_rax);
+
+        // the value comes back in rax, and its tag in rdx
+        patch_rel32(*buf, done, cvector_size(*buf));
+        store_rax(buf, reg_disp(regs, r1));
+        emit_rbp(buf, 0x89, RDX, tag_disp(reg_disp(regs, r1)));
+}
+
+/**
+ * Emits the side exit of the jumps in `exits` to the interpreter, for the
+ * function at `f`. The registers of the frame are handed to `lsp_jit_deopt`,
+ * and what it returns is the return value of the function.
+ */
+static void emit_exit(Buf *buf, LspJit jit[static 1], size_t f, int32_t regs, size_t pc) {
+        LspSideExit *exit = lsp_malloc(sizeof(LspSideExit));
+        exit->fn = f;
+        exit->pc = pc;
+        exit->caller = NULL;
+        for (size_t r = 0; r <= UINT8_MAX; ++r) {
+                exit->live[r] = (int32_t)r < regs;
+        }
+        cvector_push_back(jit->baseline.exits, exit);
+        // lsp_jit_deopt(jit, exit, &registers); leave; ret
+        mov_imm(buf, RDI, (uint64_t)jit);
+        mov_imm(buf, RSI, (uint64_t)exit);
+        emit_rbp(buf, 0x8d, RDX, reg_disp(regs, 0));
+        mov_imm(buf, RAX, (uint64_t)lsp_jit_deopt);
+        uint8_t call_rax[2] = { 0xff, 0xd0 };
+        emit(buf, 2, call_rax);
+        uint8_t epilogue[2] = { 0xc9, 0xc3 };
+        emit(buf, 2, epilogue);
+}
+
+/**
+ * Jumps to the side exit at `pc` if the condition code `cc` holds. The exits
+ * are emitted after the code of the function, once `exits` is complete.
+ */
+static void emit_exit_jump(Buf *buf, cvector_vector_type(Fixup) *exits, uint8_t cc, size_t pc) {
+        uint8_t jcc[2] = { 0x0f, 0x80 | cc };
+        Fixup jump = { .at = emit_jump(buf, 2, jcc), .target = pc };
+        cvector_push_back((*exits), jump);
+}
+
+/** Leaves through the side exit at `pc`, unless register `r` holds an integer
+that fits in a register. */
+static void emit_int_guard(Buf *buf,
+                           cvector_vector_type(Fixup) *exits,
+                           int32_t regs,
+                           uint8_t r,
+                           size_t pc) {
+        // cmp qword [tag of r], TAG_INT; jne exit
+        emit_rbp(buf, 0x83, 7, tag_disp(reg_disp(regs, r)));
+        uint8_t int_tag[1] = { TAG_INT };
+        emit(buf, 1, int_tag);
+        emit_exit_jump(buf, exits, CC_NE, pc);
+}
+
+/**
+ * Counts a call or a back-edge in the hotness of the function at `f`, and calls
+ * `lsp_jit_tier_up` once the function is hot enough to be optimized.
+ */
+static void emit_tier_up(Buf *buf, LspJit jit[static 1], size_t f) {
+        LspTiering *tiering = &jit->tiering;
+        uint64_t at = lsp_tiering_optimize_at(tiering, f);
+        if (at <= tiering->hotness[f]) {
+                at = tiering->hotness[f] + 1;
+        }
+        if (at > INT32_MAX) {
+                at = INT32_MAX;
+        }
+        // mov rax, &hotness; inc qword [rax]; cmp qword [rax], at; jne done
+        mov_imm(buf, RAX, (uint64_t)&tiering->hotness[f]);
+        uint8_t inc[3] = { 0x48, 0xff, 0x00 };
+        emit(buf, 3, inc);
+        uint8_t cmp[3] = { 0x48, 0x81, 0x38 };
+        emit(buf, 3, cmp);
+        emit_u32(buf, at);
+        uint8_t jne[2] = { 0x0f, 0x85 };
+        size_t done = emit_jump(buf, 2, jne);
+        // lsp_jit_tier_up(jit, f)
+        mov_imm(buf, RDI, (uint64_t)jit);
+        mov_imm(buf, RSI, f);
+        mov_imm(buf, RAX, (uint64_t)lsp_jit_tier_up);
+        uint8_t call_rax[2] = { 0xff, 0xd0 };
+        emit(buf, 2, call_rax);
+        patch_rel32(*buf, done, cvector_size(*buf));
+}
+
+/**
+ * Leaves the code of the function at `f` at the backward jump at `pc`, once the
+ * function has newer code. Only the parameters are live at the start of a
+ * loop, so they are all the newer code needs. Functions that went back to the
+ * interpreter continue there instead.
+ */
+static void emit_osr(Buf *buf,
+                     LspJit jit[static 1],
+                     size_t f,
+                     int32_t regs,
+                     cvector_vector_type(Fixup) *exits,
+                     size_t pc) {
+        // mov rax, &entry; mov rax, [rax]
+        mov_imm(buf, RAX, (uint64_t)&jit->entries[f]);
+        uint8_t load_entry[3] = { 0x48, 0x8b, 0x00 };
+        emit(buf, 3, load_entry);
+        // lea rcx, [start of this code]; cmp rax, rcx; je stay
+        uint8_t lea[3] = { 0x48, 0x8d, 0x0d };
+        emit(buf, 3, lea);
+        emit_u32(buf, (uint32_t)-(int64_t)(cvector_size(*buf) + 4));
+        uint8_t cmp[3] = { 0x48, 0x39, 0xc8 };
+        emit(buf, 3, cmp);
+        uint8_t je[2] = { 0x0f, 0x84 };
+        size_t same = emit_jump(buf, 2, je);
+        // test rax, rax; jz exit
+        uint8_t test[3] = { 0x48, 0x85, 0xc0 };
+        emit(buf, 3, test);
+        emit_exit_jump(buf, exits, CC_E, pc);
+        // mov rcx, &stack_limit; cmp rsp, [rcx]; jb stay
+        mov_imm(buf, RCX, (uint64_t)&jit->stack_limit);
+        uint8_t cmp_rsp[3] = { 0x48, 0x3b, 0x21 };
+        emit(buf, 3, cmp_rsp);
+        uint8_t jb[2] = { 0x0f, 0x82 };
+        size_t deep = emit_jump(buf, 2, jb);
+        // mov rcx, &osr_entries; inc qword [rcx]
+        mov_imm(buf, RCX, (uint64_t)&jit->osr_entries);
+        uint8_t inc[3] = { 0x48, 0xff, 0x01 };
+        emit(buf, 3, inc);
+        // lea rdi, [params]; call rax; leave; ret
+        emit_rbp(buf, 0x8d, RDI, reg_disp(regs, 0));
+        uint8_t call_ret[4] = { 0xff, 0xd0, 0xc9, 0xc3 };
+        emit(buf, 4, call_ret);
+        patch_rel32(*buf, same, cvector_size(*buf));
+        patch_rel32(*buf, deep, cvector_size(*buf));
+}
+
+void lsp_baseline_compile(LspJit *jit, size_t f) {
+        double start = lsp_now();
+        LspState *state = jit->vm.state;
+        LspFunc *func = &state->funcs[f];
+        size_t len = cvector_size(func->instrs);
+        Buf buf = NULL;
+        cvector_vector_type(Fixup) fixups = NULL;
+        cvector_vector_type(Fixup) exits = NULL;
+        size_t *offsets = lsp_malloc(len * sizeof(size_t));
+
+        // recursion nests native frames, so they only make room for the
+        // arguments the function actually passes
+        int32_t args = 0;
+        for (size_t pc = 0; pc < len; ++pc) {
+                LspInstr i = func->instrs[pc];
+                int32_t nargs = (int32_t)lsp_get_arg3(i) - lsp_get_arg2(i);
+                if (lsp_get_opcode(i) == OP_CALL && nargs > args) {
+                        args = nargs;
+                }
+        }
+        // push rbp; mov rbp, rsp; sub rsp, frame
+        int32_t regs = func->regs_in_use;
+        int32_t frame = 16 * (regs + args);
+        int32_t args_disp = -frame;
+        uint8_t prologue[7] = { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x81, 0xec };
+        emit(&buf, 7, prologue);
+        emit_u32(&buf, frame);
+        // registers above the parameters start out empty
+        for (uint8_t r = 0; r < func->regs_in_use; ++r) {
+                if (r < func->num_of_params) {
+                        // mov rax, [rdi + 16 * r]; mov rcx, [rdi + 16 * r + 8]
+                        uint8_t load_param[3] = { 0x48, 0x8b, 0x87 };
+                        emit(&buf, 3, load_param);
+                        emit_u32(&buf, 16 * r);
+                        uint8_t load_tag[3] = { 0x48, 0x8b, 0x8f };
+                        emit(&buf, 3, load_tag);
+                        emit_u32(&buf, 16 * r + 8);
+                } else if (r == func->num_of_params) {
+                        mov_imm(&buf, RAX, 0);
+                        mov_imm(&buf, RCX, TAG_INT);
+                }
+                store_rax(&buf, reg_disp(regs, r));
+                emit_rbp(&buf, 0x89, RCX, tag_disp(reg_disp(regs, r)));
+        }
+        if (jit->opts.tier == LSP_TIER_LLVM) {
+                emit_tier_up(&buf, jit, f);
+        }
+
+        for (size_t pc = 0; pc < len; ++pc) {
+                offsets[pc] = cvector_size(buf);
+                LspInstr i = func->instrs[pc];
+                uint8_t r1 = lsp_get_arg1(i), r2 = lsp_get_arg2(i), r3 = lsp_get_arg3(i);
+                switch (lsp_get_opcode(i)) {
+                case OP_LDC:
+                        mov_imm(&buf, RAX, state->ints[lsp_get_long_arg(i)]);
+                        store_rax(&buf, reg_disp(regs, r1));
+                        store_tag(&buf, reg_disp(regs, r1), TAG_INT);
+                        break;
+                case OP_LDF:
+                        mov_imm(&buf, RAX, r2);
+                        store_rax(&buf, reg_disp(regs, r1));
+                        store_tag(&buf, reg_disp(regs, r1), TAG_FN);
+                        break;
+                case OP_MOV:
+                        copy_value(&buf, reg_disp(regs, r1), reg_disp(regs, r2));
+                        break;
+                case OP_ADD:
+                        // add rax, [r3]; jo exit
+                        emit_int_guard(&buf, &exits, regs, r2, pc);
+                        emit_int_guard(&buf, &exits, regs, r3, pc);
+                        load_rax(&buf, reg_disp(regs, r2));
+                        emit_rbp(&buf, 0x03, RAX, reg_disp(regs, r3));
+                        emit_exit_jump(&buf, &exits, CC_O, pc);
+                        store_rax(&buf, reg_disp(regs, r1));
+                        store_tag(&buf, reg_disp(regs, r1), TAG_INT);
+                        break;
+                case OP_SUB:
+                        // sub rax, [r3]; jo exit
+                        emit_int_guard(&buf, &exits, regs, r2, pc);
+                        emit_int_guard(&buf, &exits, regs, r3, pc);
+                        load_rax(&buf, reg_disp(regs, r2));
+                        emit_rbp(&buf, 0x2b, RAX, reg_disp(regs, r3));
+                        emit_exit_jump(&buf, &exits, CC_O, pc);
+                        store_rax(&buf, reg_disp(regs, r1));
+                        store_tag(&buf, reg_disp(regs, r1), TAG_INT);
+                        break;
+                case OP_EQ: {
+                        // values of different types are never equal:
+                        // cmp rax, [r3]; sete al; cmp rcx, [tag of r3];
+                        // sete cl; and al, cl; movzx eax, al
+                        load_rax(&buf, reg_disp(regs, r2));
+                        emit_rbp(&buf, 0x3b, RAX, reg_disp(regs, r3));
+                        uint8_t sete_al[3] = { 0x0f, 0x94, 0xc0 };
+                        emit(&buf, 3, sete_al);
+                        emit_rbp(&buf, 0x8b, RCX, tag_disp(reg_disp(regs, r2)));
+                        emit_rbp(&buf, 0x3b, RCX, tag_disp(reg_disp(regs, r3)));
+                        uint8_t both[8] = { 0x0f, 0x94, 0xc1, 0x20, 0xc8, 0x0f, 0xb6, 0xc0 };
+                        emit(&buf, 8, both);
+                        store_rax(&buf, reg_disp(regs, r1));
+                        store_tag(&buf, reg_disp(regs, r1), TAG_INT);
+                } break;
+                case OP_TEST: {
+                        // functions are always true:
+                        // cmp qword [tag of r1], TAG_FN; je pc + 2;
+                        // cmp qword [r1], 0; jne pc + 2
+                        emit_rbp(&buf, 0x83, 7, tag_disp(reg_disp(regs, r1)));
+                        uint8_t fn_tag[1] = { TAG_FN };
+                        emit(&buf, 1, fn_tag);
+                        uint8_t je[2] = { 0x0f, 0x84 };
+                        Fixup is_fn = { .at = emit_jump(&buf, 2, je), .target = pc + 2 };
+                        cvector_push_back(fixups, is_fn);
+                        emit_rbp(&buf, 0x83, 7, reg_disp(regs, r1));
+                        uint8_t zero[1] = { 0 };
+                        emit(&buf, 1, zero);
+                        uint8_t jne[2] = { 0x0f, 0x85 };
+                        Fixup fixup = { .at = emit_jump(&buf, 2, jne), .target = pc + 2 };
+                        cvector_push_back(fixups, fixup);
+                } break;
+                case OP_JMP: {
+                        // loops get hot without calls, and move on to newer
+                        // code without them
+                        if (lsp_get_offset(i) <= 0 && jit->opts.tier == LSP_TIER_LLVM) {
+                                emit_tier_up(&buf, jit, f);
+                                emit_osr(&buf, jit, f, regs, &exits, pc);
+                        }
+                        uint8_t jmp[1] = { 0xe9 };
+                        Fixup fixup = {
+                                .at = emit_jump(&buf, 1, jmp),
+                                .target = pc + lsp_get_offset(i),
+                        };
+                        cvector_push_back(fixups, fixup);
+                } break;
+                case OP_CALL: {
+                        emit_call(&buf, jit, regs, args_disp, r1, r2, r3);
+                        // integers too big for native code are left to the
+                        // interpreter: cmp rdx, LSP_NATIVE_BIG; je exit
+                        uint8_t cmp_big[4] = { 0x48, 0x83, 0xfa, LSP_NATIVE_BIG };
+                        emit(&buf, 4, cmp_big);
+                        emit_exit_jump(&buf, &exits, CC_E, pc + 1);
+                } break;
+                case OP_RET: {
+                        // mov rdx, [tag of r1]; leave; ret
+                        load_rax(&buf, reg_disp(regs, r1));
+                        emit_rbp(&buf, 0x8b, RDX, tag_disp(reg_disp(regs, r1)));
+                        uint8_t epilogue[2] = { 0xc9, 0xc3 };
+                        emit(&buf, 2, epilogue);
+                } break;
+                }
+        }
+        for (size_t i = 0; i < cvector_size(fixups); ++i) {
+                patch_rel32(buf, fixups[i].at, offsets[fixups[i].target]);
+        }
+        for (size_t i = 0; i < cvector_size(exits); ++i) {
+                patch_rel32(buf, exits[i].at, cvector_size(buf));
+                emit_exit(&buf, jit, f, regs, exits[i].target);
+        }
+
+        LspBaselineCode code = {
+                .f = f,
+                .start = lsp_map_code(buf, cvector_size(buf)),
+                .len = cvector_size(buf),
+        };
+        cvector_push_back(jit->baseline.code, code);
+        atomic_store_explicit(&jit->entries[f], (LspNativeFn)(uintptr_t)code.start, memory_order_release);
+        jit->baseline.compiled++;
+        jit->baseline.compile_time += lsp_now() - start;
+        free(offsets);
+        cvector_free(fixups);
+        cvector_free(exits);
+        cvector_free(buf);
+}
+
+void* lsp_baseline_entry(const LspBaseline self[static 1], size_t f) {
+        for (size_t i = 0; i < cvector_size(self->code); ++i) {
+                if (self->code[i].f == f) {
+                        return self->code[i].start;
+                }
+        }
+        return NULL;
+}
+
+void lsp_baseline_print_stats(const LspBaseline self[static 1]) {
+        printf("Baseline: %ld functions compiled in %.1fus.\n",
+               self->compiled,
+               self->compile_time * 1e6);
+}
+
+void lsp_baseline_free(LspBaseline self[static 1]) {
+        for (size_t i = 0; i < cvector_size(self->code); ++i) {
+                lsp_unmap_code(self->code[i].start, self->code[i].len);
+        }
+        cvector_free(self->code);
+        for (size_t i = 0; i < cvector_size(self->exits); ++i) {
+                free(self->exits[i]);
+        }
+        cvector_free(self->exits);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cvector.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct LspJit;
+struct LspSideExit;
+
+/** Machine code emitted by the baseline compiler for the function at `f`. */
+typedef struct LspBaselineCode {
+        size_t f;
+        void *start;
+        size_t len;
+} LspBaselineCode;
+
+/**
+ * A compiler from bytecode straight to x86-64, which doesn't go through LLVM.
+ *
+ * Every instruction is translated on its own, with registers living in the
+ * stack frame of the native code. There are no traces, so both sides of every
+ * branch are compiled. The interpreter only takes over when an integer doesn't
+ * fit in an int64 anymore, through the same side exits as code compiled by
+ * LLVM. Compiled functions follow the same convention as the ones compiled by
+ * LLVM.
+ */
+typedef struct LspBaseline {
+        cvector_vector_type(LspBaselineCode) code;
+        /* The side exits of the compiled code. */
+        cvector_vector_type(struct LspSideExit*) exits;
+        /* The number of compiled functions, and the time it took. */
+        size_t compiled;
+        double compile_time;
+} LspBaseline;
+
+LspBaseline lsp_baseline_new();
+
+/** Returns whether this platform is supported by the baseline compiler. */
+bool lsp_baseline_supported();
+
+/** Compiles the function at `f`, and sets its entry point. */
+void lsp_baseline_compile(struct LspJit *jit, size_t f);
+
+/** The code of the function at `f`, or NULL if it wasn't compiled. */
+void* lsp_baseline_entry(const LspBaseline self[static 1], size_t f);
+
+void lsp_baseline_print_stats(const LspBaseline self[static 1]);
+
+void lsp_baseline_free(LspBaseline self[static 1]);
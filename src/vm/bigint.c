@@ -0,0 +1,173 @@
+#include "bigint.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** The sign and magnitude of an integer, boxed or not. */
+typedef struct Magnitude {
+        bool negative;
+        size_t len;
+        const uint64_t *limbs;
+        /* Where the magnitude of a small integer is kept. */
+        uint64_t small;
+} Magnitude;
+
+static void unpack(LspValue v, Magnitude m[static 1]) {
+        if (lsp_is_small(v)) {
+                int64_t n = lsp_get_small(v);
+                m->negative = n < 0;
+                m->small = n < 0 ? -(uint64_t)n : (uint64_t)n;
+                m->len = m->small != 0;
+                m->limbs = &m->small;
+        } else {
+                LspBox *box = lsp_get_box(v);
+                m->negative = box->size < 0;
+                m->len = box->size < 0 ? -box->size : box->size;
+                m->limbs = box->limbs;
+        }
+}
+
+/** Compares the magnitudes of `a` and `b`, like `memcmp`. */
+static int compare(const Magnitude a[static 1], const Magnitude b[static 1]) {
+        if (a->len != b->len) {
+                return a->len < b->len ? -1 : 1;
+        }
+        for (size_t i = a->len; i > 0; --i) {
+                if (a->limbs[i - 1] != b->limbs[i - 1]) {
+                        return a->limbs[i - 1] < b->limbs[i - 1] ? -1 : 1;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Turns `box`, whose first `len` limbs hold the magnitude, into a value. The
+ * box is left unused if the integer fits in 63 bits.
+ */
+static LspValue finish(LspBox *box, size_t len, bool negative) {
+        while (len > 0 && box->limbs[len - 1] == 0) {
+                len--;
+        }
+        if (len == 0) {
+                return lsp_new_small(0);
+        }
+        if (len == 1) {
+                uint64_t n = box->limbs[0];
+                if (!negative && n <= LSP_SMALL_MAX) {
+                        return lsp_new_small(n);
+                }
+                if (negative && n <= -(uint64_t)LSP_SMALL_MIN) {
+                        return lsp_new_small(-(int64_t)n);
+                }
+        }
+        box->size = negative ? -(int64_t)len : (int64_t)len;
+        return lsp_new_box(box);
+}
+
+/** `a` + `b`, where `b` is negated if `negate_b` is set. */
+static LspValue add_signed(LspArena arena[static 1],
+                           const Magnitude a[static 1],
+                           const Magnitude b[static 1],
+                           bool negate_b) {
+        bool b_negative = b->negative != negate_b;
+        if (a->negative == b_negative) {
+                // |a| + |b|, which has one more limb at most
+                size_t len = (a->len > b->len ? a->len : b->len) + 1;
+                LspBox *box = lsp_alloc_box(arena, len);
+                uint64_t carry = 0;
+                for (size_t i = 0; i < len; ++i) {
+                        uint64_t x = i < a->len ? a->limbs[i] : 0;
+                        uint64_t y = i < b->len ? b->limbs[i] : 0;
+                        uint64_t sum = x + y;
+                        uint64_t c = sum < x;
+                        box->limbs[i] = sum + carry;
+                        carry = c | (box->limbs[i] < sum);
+                }
+                return finish(box, len, a->negative);
+        }
+        // the larger magnitude minus the smaller one, with the sign of the
+        // larger one
+        const Magnitude *big = a, *small = b;
+        bool negative = a->negative;
+        if (compare(a, b) < 0) {
+                big = b;
+                small = a;
+                negative = b_negative;
+        }
+        LspBox *box = lsp_alloc_box(arena, big->len);
+        uint64_t borrow = 0;
+        for (size_t i = 0; i < big->len; ++i) {
+                uint64_t x = big->limbs[i];
+                uint64_t y = i < small->len ? small->limbs[i] : 0;
+                uint64_t diff = x - y;
+                uint64_t under = diff > x;
+                box->limbs[i] = diff - borrow;
+                borrow = under | (box->limbs[i] > diff);
+        }
+        return finish(box, big->len, negative);
+}
+
+LspValue lsp_big_add(LspArena arena[static 1], LspValue a, LspValue b) {
+        Magnitude ma, mb;
+        unpack(a, &ma);
+        unpack(b, &mb);
+        return add_signed(arena, &ma, &mb, false);
+}
+
+LspValue lsp_big_sub(LspArena arena[static 1], LspValue a, LspValue b) {
+        Magnitude ma, mb;
+        unpack(a, &ma);
+        unpack(b, &mb);
+        return add_signed(arena, &ma, &mb, true);
+}
+
+bool lsp_big_eq(LspValue a, LspValue b) {
+        Magnitude ma, mb;
+        unpack(a, &ma);
+        unpack(b, &mb);
+        return ma.negative == mb.negative && compare(&ma, &mb) == 0;
+}
+
+#define DIGITS_PER_CHUNK 9
+#define CHUNK 1000000000u
+
+void lsp_big_print(LspValue v) {
+        Magnitude m;
+        unpack(v, &m);
+        if (m.len == 0) {
+                printf("0");
+                return;
+        }
+        // divide a copy of the magnitude by 10^9 until nothing is left, the
+        // remainders are the digits from the right, 9 at a time
+        uint64_t *limbs = lsp_malloc(m.len * sizeof(uint64_t));
+        memcpy(limbs, m.limbs, m.len * sizeof(uint64_t));
+        size_t len = m.len;
+        // 64 bits need fewer than 20 digits
+        uint32_t *chunks = lsp_malloc((m.len * 20 / DIGITS_PER_CHUNK + 1) * sizeof(uint32_t));
+        size_t n_chunks = 0;
+        while (len > 0) {
+                uint64_t rem = 0;
+                for (size_t i = len; i > 0; --i) {
+                        // one half of the limb at a time, so that the
+                        // remainder and the half fit in 64 bits
+                        uint64_t hi = (rem << 32) | (limbs[i - 1] >> 32);
+                        rem = hi % CHUNK;
+                        uint64_t lo = (rem << 32) | (limbs[i - 1] & 0xffffffff);
+                        rem = lo % CHUNK;
+                        limbs[i - 1] = ((hi / CHUNK) << 32) | (lo / CHUNK);
+                }
+                chunks[n_chunks++] = rem;
+                while (len > 0 && limbs[len - 1] == 0) {
+                        len--;
+                }
+        }
+        printf("%s%u", m.negative ? "-" : "", chunks[n_chunks - 1]);
+        for (size_t i = n_chunks - 1; i > 0; --i) {
+                printf("%0*u", DIGITS_PER_CHUNK, chunks[i - 1]);
+        }
+        free(chunks);
+        free(limbs);
+}
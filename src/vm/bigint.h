@@ -0,0 +1,24 @@
+#pragma once
+
+#include "arena.h"
+#include "value.h"
+
+#include <stdbool.h>
+
+/*
+ * Arithmetic on integers of any size. These are the slow paths of the VM,
+ * taken once an integer doesn't fit in 63 bits: results are boxed in `arena`
+ * only if they have to be.
+ */
+
+/** `a` + `b`. */
+LspValue lsp_big_add(LspArena arena[static 1], LspValue a, LspValue b);
+
+/** `a` - `b`. */
+LspValue lsp_big_sub(LspArena arena[static 1], LspValue a, LspValue b);
+
+/** Whether the integers `a` and `b` are equal. */
+bool lsp_big_eq(LspValue a, LspValue b);
+
+/** Prints the integer `v` in decimal. */
+void lsp_big_print(LspValue v);
@@ -0,0 +1,218 @@
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+/** Bump this whenever the code generated for a function changes. */
+#define LSP_CACHE_VERSION 5
+
+static void evict(LspCodeCache self[static 1]);
+
+LspCodeCache lsp_cache_new(const char *dir, size_t limit) {
+        LspCodeCache cache = {
+                .dir = NULL,
+                .limit = limit,
+                .size = 0,
+                .hits = 0,
+                .misses = 0,
+                .load_time = 0,
+        };
+        if (dir) {
+                if (mkdir(dir, 0755) && access(dir, W_OK)) {
+                        printf("Cannot use %s as a code cache.\n", dir);
+                        exit(1);
+                }
+                cache.dir = lsp_malloc(strlen(dir) + 1);
+                strcpy(cache.dir, dir);
+                // also finds out how big the cache is
+                evict(&cache);
+        }
+        return cache;
+}
+
+static uint64_t hash(uint64_t h, const void *data, size_t len) {
+        // FNV-1a
+        const uint8_t *bytes = data;
+        for (size_t i = 0; i < len; ++i) {
+                h ^= bytes[i];
+                h *= 0x100000001b3;
+        }
+        return h;
+}
+
+/**
+ * Hashes the code of the function at `f`, and of the functions it loads, up to
+ * `depth` calls deep.
+ */
+static uint64_t hash_func(uint64_t h, const LspState state[static 1], size_t f, unsigned depth) {
+        const LspFunc *fn = &state->funcs[f];
+        // names the native code
+        h = hash(h, fn->name, strlen(fn->name));
+        h = hash(h, fn->instrs, cvector_size(fn->instrs) * sizeof(LspInstr));
+        for (size_t i = 0; i < cvector_size(fn->instrs); ++i) {
+                LspInstr instr = fn->instrs[i];
+                if (lsp_get_opcode(instr) == OP_LDC) {
+                        // constants are inlined in the code
+                        int64_t n = state->ints[lsp_get_long_arg(instr)];
+                        h = hash(h, &n, sizeof(n));
+                } else if (lsp_get_opcode(instr) == OP_LDF && depth > 0) {
+                        h = hash_func(h, state, lsp_get_arg2(instr), depth - 1);
+                }
+        }
+        return h;
+}
+
+uint64_t lsp_cache_key(const LspState state[static 1],
+                       size_t f,
+                       unsigned opt_level,
+                       unsigned inline_depth) {
+        const LspFunc *fn = &state->funcs[f];
+        uint64_t h = 0xcbf29ce484222325;
+        uint32_t header[5] = { LSP_CACHE_VERSION, f, fn->num_of_params, opt_level, inline_depth };
+        h = hash(h, header, sizeof(header));
+        return hash_func(h, state, f, inline_depth);
+}
+
+static char* entry_path(const LspCodeCache self[static 1], const char *name) {
+        char *path = lsp_malloc(strlen(self->dir) + strlen(name) + 2);
+        sprintf(path, "%s/%s", self->dir, name);
+        return path;
+}
+
+static char* key_path(const LspCodeCache self[static 1], uint64_t key) {
+        char name[32];
+        sprintf(name, "%016lx.bc", key);
+        return entry_path(self, name);
+}
+
+LLVMModuleRef lsp_cache_load(LspCodeCache self[static 1], uint64_t key) {
+        if (!self->dir) {
+                return NULL;
+        }
+        char *path = key_path(self, key);
+        LLVMMemoryBufferRef buf;
+        LLVMModuleRef mod = NULL;
+        char *error = NULL;
+        if (!LLVMCreateMemoryBufferWithContentsOfFile(path, &buf, &error)) {
+                if (LLVMParseBitcode2(buf, &mod)) {
+                        mod = NULL;
+                }
+                LLVMDisposeMemoryBuffer(buf);
+        } else {
+                LLVMDisposeMessage(error);
+        }
+        if (mod) {
+                // the modification time orders entries for eviction
+                utime(path, NULL);
+                self->hits++;
+        } else {
+                self->misses++;
+        }
+        free(path);
+        return mod;
+}
+
+typedef struct CacheEntry {
+        char *path;
+        time_t used;
+        size_t size;
+} CacheEntry;
+
+static int by_use(const void *a, const void *b) {
+        time_t t1 = ((const CacheEntry*)a)->used, t2 = ((const CacheEntry*)b)->used;
+        return (t1 > t2) - (t1 < t2);
+}
+
+/**
+ * Removes the least recently used entries until the cache fits its limit, and
+ * updates its size.
+ */
+static void evict(LspCodeCache self[static 1]) {
+        DIR *dir = opendir(self->dir);
+        if (!dir) {
+                return;
+        }
+        cvector_vector_type(CacheEntry) entries = NULL;
+        size_t total = 0;
+        struct dirent *d;
+        while ((d = readdir(dir))) {
+                size_t len = strlen(d->d_name);
+                if (len < 3 || strcmp(d->d_name + len - 3, ".bc") != 0) {
+                        continue;
+                }
+                char *path = entry_path(self, d->d_name);
+                struct stat st;
+                if (stat(path, &st)) {
+                        free(path);
+                        continue;
+                }
+                CacheEntry e = { .path = path, .used = st.st_mtime, .size = st.st_size };
+                cvector_push_back(entries, e);
+                total += e.size;
+        }
+        closedir(dir);
+        // qsort doesn't take NULL, even with nothing to sort
+        if (entries) {
+                qsort(entries, cvector_size(entries), sizeof(CacheEntry), by_use);
+        }
+        for (size_t i = 0; i < cvector_size(entries); ++i) {
+                if (total > self->limit && !unlink(entries[i].path)) {
+                        total -= entries[i].size;
+                }
+                free(entries[i].path);
+        }
+        cvector_free(entries);
+        self->size = total;
+}
+
+void lsp_cache_store(LspCodeCache self[static 1], uint64_t key, LLVMModuleRef mod) {
+        if (!self->dir) {
+                return;
+        }
+        // other processes might be reading the cache, so entries only appear
+        // once they are complete
+        char *path = key_path(self, key);
+        char *tmp = lsp_malloc(strlen(path) + 24);
+        sprintf(tmp, "%s.%d.tmp", path, getpid());
+        struct stat old, st;
+        bool replaces = !stat(path, &old);
+        if (!LLVMWriteBitcodeToFile(mod, tmp) && !stat(tmp, &st) && !rename(tmp, path)) {
+                self->size += st.st_size;
+                if (replaces && (size_t)old.st_size <= self->size) {
+                        self->size -= old.st_size;
+                }
+        } else {
+                unlink(tmp);
+        }
+        free(tmp);
+        free(path);
+        // the directory is only read again once it might be too big
+        if (self->size > self->limit) {
+                evict(self);
+        }
+}
+
+void lsp_cache_print_stats(const LspCodeCache self[static 1]) {
+        if (self->dir) {
+                printf("Code cache: %ld hits, %ld misses, %.3fms to make the hits native.\n",
+                       self->hits,
+                       self->misses,
+                       self->load_time * 1000);
+        }
+}
+
+void lsp_cache_free(LspCodeCache self[static 1]) {
+        free(self->dir);
+        self->dir = NULL;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "compiler/gen.h"
+
+#include <llvm-c/Core.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The most bytes a cache directory holds by default. */
+#define LSP_CACHE_DEFAULT_LIMIT (16 * 1024 * 1024)
+
+/**
+ * A directory of optimized functions, kept as bitcode across runs.
+ *
+ * Files are named after the key of their function. Once the directory grows
+ * past its limit, the least recently used files are removed. The C API of
+ * MCJIT only takes modules, so hits skip recording and optimizing, but are
+ * still code-generated.
+ */
+typedef struct LspCodeCache {
+        /* NULL when there is no cache. */
+        char *dir;
+        size_t limit;
+        /* The bytes in the directory, as of the last time it was read, plus
+        what was stored since. */
+        size_t size;
+        size_t hits;
+        size_t misses;
+        /* The time it took to make the hits native. */
+        double load_time;
+} LspCodeCache;
+
+LspCodeCache lsp_cache_new(const char *dir, size_t limit);
+
+/**
+ * Hashes everything the code of the function at `f` depends on, including the
+ * functions it may inline, up to `inline_depth` calls deep.
+ */
+uint64_t lsp_cache_key(const LspState state[static 1],
+                       size_t f,
+                       unsigned opt_level,
+                       unsigned inline_depth);
+
+/** Reads the module stored under `key`, or returns NULL. */
+LLVMModuleRef lsp_cache_load(LspCodeCache self[static 1], uint64_t key);
+
+void lsp_cache_store(LspCodeCache self[static 1], uint64_t key, LLVMModuleRef mod);
+
+void lsp_cache_print_stats(const LspCodeCache self[static 1]);
+
+void lsp_cache_free(LspCodeCache self[static 1]);
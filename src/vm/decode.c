@@ -0,0 +1,123 @@
+#include "decode.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+static LspDecoded decode(const LspState state[static 1], LspInstr i, size_t pc) {
+        LspDecoded d = {
+                .handler = NULL,
+                .instr = i,
+                .op = lsp_get_opcode(i),
+                .a = lsp_get_arg1(i),
+                .b = lsp_get_arg2(i),
+                .c = lsp_get_arg3(i),
+                .k = 0,
+                .target = 0,
+                .exec_op = 0,
+        };
+        switch (d.op) {
+        case OP_LDC: {
+                int64_t n = state->ints[lsp_get_long_arg(i)];
+                if (n >= LSP_SMALL_MIN && n <= LSP_SMALL_MAX) {
+                        d.k = lsp_new_small(n);
+                } else {
+                        d.op = OP_LDC_BOXED;
+                        d.index = lsp_get_long_arg(i);
+                }
+        } break;
+        case OP_LDF:
+                d.k = lsp_new_fn(d.b);
+                break;
+        case OP_CALL:
+                d.cache = lsp_malloc(sizeof(LspCallCache));
+                *d.cache = (LspCallCache){ .callees = { 0 }, .len = 0, .hits = 0, .misses = 0 };
+                // parameters that weren't passed are empty, which is 0, so
+                // the first callee starts out as a value no call can have
+                d.cache->callees[0] = lsp_new_small(0);
+                break;
+        case OP_TEST:
+                // if the register holds a truthy value, skip the next instr
+                d.target = pc + 2;
+                break;
+        case OP_JMP:
+                d.target = pc + lsp_get_offset(i);
+                break;
+        }
+        return d;
+}
+
+/** Whether `code` tests `reg`, and jumps forward if it is false. Backward
+jumps stay apart, so that their back-edge is still counted. */
+static bool is_cond_jump(const LspDecoded code[static 3], uint8_t reg) {
+        return code[1].op == OP_TEST && code[1].a == reg && code[2].op == OP_JMP
+            && lsp_get_offset(code[2].instr) > 0;
+}
+
+void lsp_fuse_superinstrs(cvector_vector_type(LspDecoded) code) {
+        size_t len = cvector_size(code);
+        for (size_t pc = 0; pc < len; ++pc) {
+                LspDecoded *d = &code[pc];
+                size_t left = len - pc;
+                if (d->op == OP_LDC && left >= 4 && code[pc + 1].op == OP_EQ
+                    && (code[pc + 1].b == d->a || code[pc + 1].c == d->a)
+                    && is_cond_jump(&code[pc + 1], code[pc + 1].a)) {
+                        // EQ is commutative, so the constant can be either operand
+                        LspDecoded *e = &code[pc + 1];
+                        d->op = OP_LDC_EQ_JMP;
+                        d->c = d->a;
+                        d->a = e->a;
+                        d->b = e->b == d->c ? e->c : e->b;
+                        d->target = code[pc + 3].target;
+                } else if (d->op == OP_EQ && left >= 3 && is_cond_jump(d, d->a)) {
+                        d->op = OP_EQ_JMP;
+                        d->target = code[pc + 2].target;
+                } else if (d->op == OP_LDC && left >= 2 && code[pc + 1].op == OP_ADD
+                           && (code[pc + 1].b == d->a || code[pc + 1].c == d->a)) {
+                        LspDecoded *e = &code[pc + 1];
+                        d->op = OP_LDC_ADD;
+                        d->c = d->a;
+                        d->a = e->a;
+                        d->b = e->b == d->c ? e->c : e->b;
+                } else if (d->op == OP_LDC && left >= 2 && code[pc + 1].op == OP_SUB
+                           && code[pc + 1].c == d->a) {
+                        LspDecoded *e = &code[pc + 1];
+                        d->op = OP_LDC_SUB;
+                        d->c = d->a;
+                        d->a = e->a;
+                        d->b = e->b;
+                }
+        }
+}
+
+cvector_vector_type(LspDecoded) lsp_decode_func(const LspState state[static 1],
+                                                const LspFunc f[static 1],
+                                                bool recording,
+                                                const void *const *handlers) {
+        cvector_vector_type(LspDecoded) code = NULL;
+        for (size_t pc = 0; pc < cvector_size(f->instrs); ++pc) {
+                cvector_push_back(code, decode(state, f->instrs[pc], pc));
+        }
+        if (recording) {
+                for (size_t pc = 0; pc < cvector_size(code); ++pc) {
+                        code[pc].exec_op = code[pc].op;
+                        code[pc].op = OP_RECORD;
+                }
+        } else {
+                lsp_fuse_superinstrs(code);
+        }
+        if (handlers) {
+                for (size_t pc = 0; pc < cvector_size(code); ++pc) {
+                        code[pc].handler = handlers[code[pc].op];
+                }
+        }
+        return code;
+}
+
+void lsp_free_decoded(cvector_vector_type(LspDecoded) code) {
+        for (size_t pc = 0; pc < cvector_size(code); ++pc) {
+                if (lsp_get_opcode(code[pc].instr) == OP_CALL) {
+                        free(code[pc].cache);
+                }
+        }
+        cvector_free(code);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "arena.h"
+#include "compiler/gen.h"
+#include "value.h"
+
+/** Opcodes that only exist in decoded code. */
+enum {
+        // LDC of a constant that doesn't fit in an immediate
+        OP_LDC_BOXED = LSP_NUM_OPCODES,
+        // superinstructions, see `lsp_fuse_superinstrs`
+        // EQ A B C; TEST A; JMP target
+        OP_EQ_JMP,
+        // LDC C k; EQ A B C; TEST A; JMP target
+        OP_LDC_EQ_JMP,
+        // LDC C k; ADD A B C
+        OP_LDC_ADD,
+        // LDC C k; SUB A B C
+        OP_LDC_SUB,
+        // records the instruction in the open trace, then runs `exec_op`
+        OP_RECORD,
+        LSP_NUM_DECODED_OPCODES,
+};
+
+/* The most callees the inline cache of a call site remembers. */
+#define LSP_CALL_CACHE_SIZE 4
+
+/**
+ * The inline cache of a call site: the callees it has seen, which are known to
+ * be functions that take the arguments of the call.
+ *
+ * The first callee makes the cache monomorphic, and the interpreter checks it
+ * with a single compare. Until there is one, it is an integer, which no call
+ * passes the checks with. The others make it polymorphic, and are searched
+ * after that. Callees that don't fit anymore are checked on every call.
+ */
+typedef struct LspCallCache {
+        LspValue callees[LSP_CALL_CACHE_SIZE];
+        uint8_t len;
+        /* Calls that found their callee after the first one, and calls that
+        had to check theirs. */
+        uint64_t hits;
+        uint64_t misses;
+} LspCallCache;
+
+/**
+ * An instruction, decoded once when the program is loaded.
+ *
+ * Register operands are offsets from the frame pointer, and jump targets are
+ * absolute indices into the decoded code of the function.
+ */
+typedef struct LspDecoded {
+        /* The address of the handler of `op` when using threaded dispatch. */
+        const void *handler;
+        /* The original instruction, for the trace recorder. */
+        LspInstr instr;
+        uint8_t op;
+        uint8_t a;
+        uint8_t b;
+        uint8_t c;
+        union {
+                /* LDC/LDF: the value to load. */
+                LspValue k;
+                /* LDC_BOXED: the index of the constant. */
+                size_t index;
+                /* CALL: the inline cache of the call site, which is owned by
+                the instruction. */
+                LspCallCache *cache;
+        };
+        /* TEST/JMP: where to go next. */
+        uint32_t target;
+        /* RECORD: the opcode to run once the instruction is recorded. */
+        uint8_t exec_op;
+} LspDecoded;
+
+/**
+ * Replaces common sequences of instructions with a single superinstruction,
+ * which does the work of the whole sequence in one dispatch.
+ *
+ * Only the first record of a sequence is replaced, so jumps into the middle of
+ * a sequence still work. A superinstruction writes every register the
+ * original sequence writes.
+ */
+void lsp_fuse_superinstrs(cvector_vector_type(LspDecoded) code);
+
+/**
+ * Decodes the instructions of `f`.
+ *
+ * When `recording` is set, every record first goes through OP_RECORD, and no
+ * superinstructions are formed, so that each instruction gets traced. Otherwise
+ * the code is fused into superinstructions.
+ *
+ * \param `handlers` The handler address of each opcode, or NULL if the
+ * interpreter doesn't use threaded dispatch.
+ */
+cvector_vector_type(LspDecoded) lsp_decode_func(const LspState state[static 1],
+                                                const LspFunc f[static 1],
+                                                bool recording,
+                                                const void *const *handlers);
+
+/** Frees the decoded code of a function, along with its inline caches. */
+void lsp_free_decoded(cvector_vector_type(LspDecoded) code);
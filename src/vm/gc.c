@@ -0,0 +1,68 @@
+#include "gc.h"
+#include "jit.h"
+
+#include <stdio.h>
+
+#define LSP_GC_MIN_THRESHOLD (64 * 1024)
+
+LspGc lsp_gc_new() {
+        LspGc gc = {
+                .threshold = LSP_GC_MIN_THRESHOLD,
+                .collections = 0,
+                .collected = 0,
+        };
+        return gc;
+}
+
+void lsp_gc_safepoint(LspVm *vm) {
+        if (vm->arena.in_use >= vm->gc.threshold) {
+                lsp_gc_collect(vm);
+        }
+}
+
+static LspValue evacuate(LspArena to[static 1], LspValue v) {
+        if (!lsp_is_boxed(v)) {
+                return v;
+        }
+        LspBox *box = lsp_get_box(v);
+        if (!box->forward) {
+                box->forward = lsp_get_box(lsp_copy_box(to, box));
+        }
+        return lsp_new_box(box->forward);
+}
+
+void lsp_gc_collect(LspVm *vm) {
+        LspArena to = lsp_arena_new();
+        size_t frame = 0;
+        for (size_t i = 0; i < vm->regs_top; ++i) {
+                // frames are laid out in register order, and a frame only
+                // references values of its own or of older frames
+                while (frame < cvector_size(vm->frames)
+                       && vm->frames[frame].regs_start <= i) {
+                        vm->frames[frame++].mark = lsp_arena_mark(&to);
+                }
+                vm->regs[i] = evacuate(&to, vm->regs[i]);
+        }
+        for (; frame < cvector_size(vm->frames); ++frame) {
+                vm->frames[frame].mark = lsp_arena_mark(&to);
+        }
+
+        LspArena from = vm->arena;
+        size_t collected = from.in_use - to.in_use;
+        to.allocated = from.allocated;
+        to.released = from.released;
+        lsp_arena_free(&from);
+        vm->arena = to;
+
+        vm->gc.collections++;
+        vm->gc.collected += collected;
+        vm->gc.threshold = 2 * to.in_use > LSP_GC_MIN_THRESHOLD
+                ? 2 * to.in_use
+                : LSP_GC_MIN_THRESHOLD;
+}
+
+void lsp_gc_print_stats(const LspGc self[static 1]) {
+        printf("GC: %ld collections, %ld bytes collected.\n",
+               self->collections,
+               self->collected);
+}
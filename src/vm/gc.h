@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+struct LspVm;
+
+/**
+ * A copying collector for the boxed values of the VM.
+ *
+ * The registers of the VM are the only roots. Live values are evacuated into
+ * a fresh arena in register order, so every stack frame still owns a
+ * contiguous region that can be released when the frame is popped.
+ */
+typedef struct LspGc {
+        /* Collect when the arena holds at least this many bytes. */
+        size_t threshold;
+        size_t collections;
+        /* Total number of bytes reclaimed by collections. */
+        size_t collected;
+} LspGc;
+
+LspGc lsp_gc_new();
+
+/** Collects the garbage of `vm` if its arena grew past the threshold. This
+should only be called when all live values are stored in registers. */
+void lsp_gc_safepoint(struct LspVm *vm);
+
+void lsp_gc_collect(struct LspVm *vm);
+
+void lsp_gc_print_stats(const LspGc self[static 1]);
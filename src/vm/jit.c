@@ -1,11 +1,30 @@
 #include "jit.h"
+#include "bigint.h"
 
-LspJit lsp_jit_new(LspState s[static 1]) {
+#include <string.h>
+
+LspJitOpts lsp_jit_default_opts() {
+        LspJitOpts opts = {
+                .enabled = true,
+                .tier = LSP_TIER_LLVM,
+                .tiering = lsp_tier_default_opts(),
+                .opt_level = 2,
+                .dump_ir = false,
+                .background = true,
+                .cache_dir = NULL,
+                .cache_limit = LSP_CACHE_DEFAULT_LIMIT,
+        };
+        return opts;
+}
+
+LspJit lsp_jit_new(LspState s[static 1], LspJitOpts opts) {
         LLVMLinkInMCJIT();
         LLVMInitializeNativeTarget();
         LLVMInitializeNativeAsmPrinter();
 
-        LLVMModuleRef mod = LLVMModuleCreateWithName("compiled_func");
+        // compiled functions get a module each, which is added to the engine
+        // once it's ready, so the engine starts out empty
+        LLVMModuleRef mod = LLVMModuleCreateWithName("lsp");
         LLVMExecutionEngineRef engine;
         char *error = NULL;
         if (LLVMCreateExecutionEngineForModule(&engine, mod, &error)) {
@@ -13,43 +32,134 @@ LspJit lsp_jit_new(LspState s[static 1]) {
                 exit(1);
         }
 
+        LLVMPassManagerBuilderRef builder = LLVMPassManagerBuilderCreate();
+        LLVMPassManagerBuilderSetOptLevel(builder, opts.opt_level);
+        LLVMPassManagerRef passes = LLVMCreatePassManager();
+        LLVMPassManagerBuilderPopulateModulePassManager(builder, passes);
+        LLVMPassManagerBuilderDispose(builder);
+
         LspVm vm = lsp_new_vm(s);
-        LLVMValueRef *compiled_funcs = NULL;
+        _Atomic(LspNativeFn) *entries = NULL;
+        uint8_t **param_tags = NULL;
         for (size_t i = 0; i < cvector_size(s->funcs); ++i) {
-                cvector_push_back(compiled_funcs, NULL);
+                cvector_push_back(entries, NULL);
+                uint8_t *tags = lsp_malloc(s->funcs[i].num_of_params + 1);
+                memset(tags, LSP_TAG_UNSEEN, s->funcs[i].num_of_params + 1);
+                cvector_push_back(param_tags, tags);
         }
         LspJit jit = {
                 .traces = lsp_trace_map_new(),
                 .open_traces = NULL,
                 .vm = vm,
-                .module = mod,
                 .engine = engine,
-                .compiled_funcs = compiled_funcs,
+                .passes = passes,
+                .tiering = lsp_tiering_new(s, opts.tiering),
+                .param_tags = param_tags,
+                .entries = entries,
+                .cache = lsp_cache_new(opts.cache_dir, opts.cache_limit),
+                .baseline = lsp_baseline_new(),
+                .stack_limit = 0,
+                .native_big = NULL,
+                .opts = opts,
+                .compiled = 0,
+                .compile_time = 0,
+                .osr_entries = 0,
+                .compiler_started = false,
+                .compiler_stopping = false,
+                .jobs = NULL,
         };
         return jit;
 }
 
 void lsp_jit_free(LspJit self[static 1]) {
+        lsp_jit_stop_compiler(self);
         lsp_trace_map_free(&self->traces);
         cvector_free(self->open_traces);
-        cvector_free(self->compiled_funcs);
+        lsp_tiering_free(&self->tiering);
+        for (size_t i = 0; i < cvector_size(self->param_tags); ++i) {
+                free(self->param_tags[i]);
+        }
+        cvector_free(self->param_tags);
+        cvector_free(self->entries);
+        lsp_cache_free(&self->cache);
+        lsp_baseline_free(&self->baseline);
+        free(self->native_big);
         lsp_cleanup_vm(&self->vm);
+        LLVMDisposePassManager(self->passes);
         LLVMDisposeExecutionEngine(self->engine);
 }
 
+/** Prints how the inline caches of the call sites of the program did. */
+static void print_call_stats(LspJit self[static 1]) {
+        size_t sites[LSP_CALL_CACHE_SIZE + 1] = { 0 };
+        uint64_t hits = 0, misses = 0;
+        LspVm *vm = &self->vm;
+        for (size_t f = 0; f < cvector_size(vm->code); ++f) {
+                cvector_vector_type(LspDecoded) code[2] = { vm->code[f], vm->recording_code[f] };
+                for (size_t i = 0; i < 2; ++i) {
+                        for (size_t pc = 0; pc < cvector_size(code[i]); ++pc) {
+                                if (lsp_get_opcode(code[i][pc].instr) != OP_CALL) {
+                                        continue;
+                                }
+                                LspCallCache *cache = code[i][pc].cache;
+                                sites[cache->len]++;
+                                hits += cache->hits;
+                                misses += cache->misses;
+                        }
+                }
+        }
+        size_t poly = 0;
+        for (size_t len = 2; len <= LSP_CALL_CACHE_SIZE; ++len) {
+                poly += sites[len];
+        }
+        printf("Inline caches: %ld monomorphic and %ld polymorphic call sites, "
+               "%ld polymorphic hits, %ld misses.\n",
+               sites[1],
+               poly,
+               hits,
+               misses);
+}
+
+void lsp_jit_print_stats(LspJit self[static 1]) {
+        assert(!self->compiler_started);
+        printf("JIT: %ld functions compiled in %.3fms, %ld loops moved into compiled code.\n",
+               self->compiled,
+               self->compile_time * 1000,
+               self->osr_entries);
+        lsp_cache_print_stats(&self->cache);
+        lsp_baseline_print_stats(&self->baseline);
+        lsp_tiering_print_stats(&self->tiering);
+        print_call_stats(self);
+}
+
 void lsp_jit_trace_start(LspJit self[static 1]) {
-        TraceNode empty = lsp_trace_node_new(0, NODE_MD_NONE);
+        if (!self->opts.enabled) {
+                return;
+        }
+        TraceNode empty = lsp_trace_node_new(0, 0, NODE_MD_NONE);
         cvector_push_back(self->open_traces, lsp_trace_list_new(empty));
 }
 
-void lsp_jit_record(LspJit self[static 1], LspInstr i) {
-        // skip jmp instructions for now
+/**
+ * Opens a trace that records nothing, for a frame that doesn't start at the
+ * beginning of its function.
+ */
+static void skip_trace(LspJit self[static 1]) {
+        if (!self->opts.enabled) {
+                return;
+        }
+        TraceList skipped = { .head = NULL, .tail = NULL };
+        cvector_push_back(self->open_traces, skipped);
+}
+
+void lsp_jit_record(LspJit self[static 1], LspInstr i, size_t pc) {
+        // forward jumps are implied by the tests before them
         uint8_t opcode = lsp_get_opcode(i);
-        if (opcode == OP_JMP) {
+        if (opcode == OP_JMP && lsp_get_offset(i) >= 0) {
                 return;
         }
         size_t last = cvector_size(self->open_traces);
-        if (last == 0) {
+        if (last == 0 || !self->open_traces[last - 1].head) {
                 return;
         }
         NodeMetadata md = NODE_MD_NONE;
@@ -57,359 +167,1662 @@ void lsp_jit_record(LspJit self[static 1], LspInstr i) {
                 LspValue val = self->vm.regs[lsp_get_arg1(i) + self->vm.regs_start];
                 md = lsp_val_to_bool(val) == true ? NODE_MD_TRUE : NODE_MD_FALSE;
         }
-        lsp_trace_list_add(&self->open_traces[last - 1], lsp_trace_node_new(i, md));
+        lsp_trace_list_add(&self->open_traces[last - 1], lsp_trace_node_new(i, pc, md));
 }
 
-int lsp_dispatch() {
-        printf("DISPATCHED!\n");
-        return 1;
+static LLVMValueRef const_int(int64_t i) {
+        return LLVMConstInt(LLVMInt64Type(), i, 0);
 }
 
-void guard_handler() {
-        printf("ABORTING\n");
-        exit(1);
+/** The type of LspNativeValue. */
+static LLVMTypeRef native_value_type() {
+        LLVMTypeRef fields[2] = { LLVMInt64Type(), LLVMInt64Type() };
+        return LLVMStructType(fields, 2, false);
 }
 
-static LLVMValueRef const_int(int64_t i) {
-        return LLVMConstInt(LLVMInt64Type(), i, 0);
+/** The caller of a function inlined into compiled code. */
+typedef struct InlineFrame {
+        size_t f;
+        /* The pc of the call. */
+        uint64_t pc;
+        /* The registers of the caller at the call. */
+        LLVMValueRef *regs;
+        LLVMValueRef *tags;
+} InlineFrame;
+
+/** What compiling the paths of a trace tree shares. */
+typedef struct TraceCompiler {
+        LspJit *jit;
+        LLVMBuilderRef builder;
+        LLVMModuleRef mod;
+        /* The function being compiled, and its index. */
+        LLVMValueRef llvm_fn;
+        size_t f;
+        /* The trace trees of the functions that can be inlined, by function,
+        or NULL. */
+        TraceNode **trees;
+        /* The function the instructions being compiled belong to, which is
+        `f` unless they are inlined. Its callers are in `inlined`, outermost
+        first. */
+        size_t curr;
+        InlineFrame inlined[LSP_INLINE_DEPTH];
+        size_t depth;
+        /* Where the returns of the function inlined last go, and the phis of
+        the value they return. */
+        LLVMBasicBlockRef ret_bb;
+        LLVMValueRef ret_reg;
+        LLVMValueRef ret_tag;
+        /* The arguments of the calls made by the trace. */
+        LLVMValueRef args;
+        /* The registers handed to the interpreter by side exits, 256 for
+        each frame. */
+        LLVMValueRef spill;
+        /* Where backward jumps go: the start of the function, once the
+        parameters are loaded. */
+        LLVMBasicBlockRef header;
+        /* The phis of the parameters at the header. Parameters whose type
+        is known keep their constant tag instead of a phi. */
+        LLVMValueRef header_regs[UINT8_MAX + 1];
+        LLVMValueRef header_tags[UINT8_MAX + 1];
+} TraceCompiler;
+
+/** Stores `v`, of type `tag`, in the LspNativeValue at `index` of `values`. */
+static void store_native(TraceCompiler c[static 1],
+                         LLVMValueRef values,
+                         size_t index,
+                         LLVMValueRef v,
+                         LLVMValueRef tag) {
+        LLVMValueRef v_is[2] = { const_int(index), LLVMConstInt(LLVMInt32Type(), 0, 0) };
+        LLVMBuildStore(c->builder, v, LLVMBuildInBoundsGEP(c->builder, values, v_is, 2, ""));
+        LLVMValueRef tag_is[2] = { const_int(index), LLVMConstInt(LLVMInt32Type(), 1, 0) };
+        LLVMBuildStore(c->builder, tag, LLVMBuildInBoundsGEP(c->builder, values, tag_is, 2, ""));
 }
 
-static void compile_trace(LspJit self[static 1], size_t f, TraceList trace[static 1]) {
-        LspFunc *func = &self->vm.state->funcs[f];
-        // int64_t f(int64_t[num_of_params])
-        LLVMTypeRef param_type[1] = { LLVMArrayType(LLVMInt64Type(), func->num_of_params) };
-        LLVMTypeRef ret_type = LLVMFunctionType(LLVMInt64Type(), param_type, 1, 0);
-        LLVMValueRef llvm_fn = LLVMAddFunction(self->module, func->name, ret_type);
+/*
+ * Compiled code only refers to the runtime through these declarations, which
+ * the engine maps to their address in the current process. This keeps the
+ * code free of addresses, so it can be cached.
+ */
 
-        LLVMTypeRef ret_type2 = LLVMFunctionType(LLVMInt64Type(), NULL, 0, 0);
-        LLVMAddFunction(self->module, "lsp_dispatch", ret_type2);
-        LLVMTypeRef dispatch_fn_ptr = LLVMPointerType(ret_type2, 0);
-        LLVMValueRef dispatch = LLVMConstInt(LLVMInt64Type(), (uint64_t)lsp_dispatch, 0);
+/** The declaration of the runtime function `name` in `mod`. */
+static LLVMValueRef runtime_fn(LLVMModuleRef mod, const char *name, LLVMTypeRef type) {
+        LLVMValueRef fn = LLVMGetNamedFunction(mod, name);
+        return fn ? fn : LLVMAddFunction(mod, name, type);
+}
 
-        LLVMTypeRef guard_ret_type = LLVMFunctionType(LLVMVoidType(), NULL, 0, 0);
-        LLVMAddFunction(self->module, "guard_handler", guard_ret_type);
-        LLVMTypeRef guard_fn_ptr = LLVMPointerType(guard_ret_type, 0);
-        LLVMValueRef guard = LLVMConstInt(LLVMInt64Type(), (uint64_t)guard_handler, 0);
+/** The declaration of the runtime data `name` in `mod`. */
+static LLVMValueRef runtime_global(LLVMModuleRef mod, const char *name, LLVMTypeRef type) {
+        LLVMValueRef global = LLVMGetNamedGlobal(mod, name);
+        return global ? global : LLVMAddGlobal(mod, type, name);
+}
 
-        LLVMBasicBlockRef entry = LLVMAppendBasicBlock(llvm_fn, "entry");
-        LLVMBuilderRef builder = LLVMCreateBuilder();
-        LLVMPositionBuilderAtEnd(builder, entry);
-        LLVMValueRef rf = LLVMBuildIntToPtr(builder, dispatch, dispatch_fn_ptr, "");
-        LLVMValueRef guard_fn = LLVMBuildIntToPtr(builder, guard, guard_fn_ptr, "");
+/** Maps the runtime declarations that are left in `mod`. */
+static void link_runtime(LspJit self[static 1], LLVMModuleRef mod) {
+        LLVMValueRef v;
+        if ((v = LLVMGetNamedGlobal(mod, "lsp_jit"))) {
+                LLVMAddGlobalMapping(self->engine, v, self);
+        }
+        if ((v = LLVMGetNamedGlobal(mod, "lsp_stack_limit"))) {
+                LLVMAddGlobalMapping(self->engine, v, &self->stack_limit);
+        }
+        if ((v = LLVMGetNamedGlobal(mod, "lsp_entries"))) {
+                LLVMAddGlobalMapping(self->engine, v, (void*)self->entries);
+        }
+        if ((v = LLVMGetNamedFunction(mod, "lsp_jit_call"))) {
+                LLVMAddGlobalMapping(self->engine, v, (void*)(uintptr_t)lsp_jit_call);
+        }
+        if ((v = LLVMGetNamedFunction(mod, "lsp_jit_deopt"))) {
+                LLVMAddGlobalMapping(self->engine, v, (void*)(uintptr_t)lsp_jit_deopt);
+        }
+}
 
-        LLVMValueRef params = LLVMGetParam(llvm_fn, 0);
-        LLVMValueRef regs[256];
-        for (uint8_t i = 0; i < func->num_of_params; ++i) {
-                LLVMValueRef is[1] = { const_int(i) };
-                LLVMValueRef gep = LLVMBuildInBoundsGEP(builder, params, is, 1, "");
-                regs[i] = LLVMBuildLoad(builder, gep, "");
+/**
+ * Builds the LspSideExit of a frame whose registers are `regs`, and spills them
+ * at `frame` in the spill area.
+ *
+ * \param `ret_reg` The register the frame waits for a call to return into, if
+ * it is the caller of an inlined function.
+ * \param `caller` The exit of the caller of the frame, or a null pointer.
+ */
+static LLVMValueRef build_exit_info(TraceCompiler c[static 1],
+                                    size_t frame,
+                                    size_t fn,
+                                    uint64_t pc,
+                                    LLVMValueRef regs[static UINT8_MAX + 1],
+                                    LLVMValueRef tags[static UINT8_MAX + 1],
+                                    int ret_reg,
+                                    LLVMValueRef caller) {
+        char live[UINT8_MAX + 1];
+        for (size_t r = 0; r <= UINT8_MAX; ++r) {
+                live[r] = regs[r] != NULL || (int)r == ret_reg;
+                if (regs[r]) {
+                        store_native(c, c->spill, frame * (UINT8_MAX + 1) + r, regs[r], tags[r]);
+                }
+        }
+        LLVMTypeRef i64 = LLVMInt64Type();
+        LLVMTypeRef ptr = LLVMPointerType(LLVMInt8Type(), 0);
+        LLVMTypeRef bytes = LLVMArrayType(LLVMInt8Type(), UINT8_MAX + 1);
+        LLVMTypeRef fields[4] = { i64, i64, bytes, ptr };
+        LLVMValueRef values[4] = {
+                const_int(fn),
+                const_int(pc),
+                LLVMConstString(live, UINT8_MAX + 1, true),
+                caller,
+        };
+        LLVMValueRef exit = LLVMAddGlobal(c->mod, LLVMStructType(fields, 4, false), "exit");
+        LLVMSetInitializer(exit, LLVMConstStruct(values, 4, false));
+        LLVMSetGlobalConstant(exit, true);
+        LLVMSetLinkage(exit, LLVMPrivateLinkage);
+        return LLVMConstBitCast(exit, ptr);
+}
+
+/**
+ * Builds the failing side of the guard at `pc`: the registers that hold a value
+ * are spilled, and the interpreter finishes the call. Inside inlined functions,
+ * the frames of their callers are rebuilt too.
+ */
+static void build_side_exit(TraceCompiler c[static 1],
+                            uint64_t pc,
+                            LLVMValueRef regs[static UINT8_MAX + 1],
+                            LLVMValueRef tags[static UINT8_MAX + 1]) {
+        LLVMBuilderRef builder = c->builder;
+        LLVMTypeRef ptr = LLVMPointerType(LLVMInt8Type(), 0);
+        // the innermost frame comes first in the spill area
+        LLVMValueRef caller = LLVMConstNull(ptr);
+        for (size_t k = 0; k < c->depth; ++k) {
+                InlineFrame *f = &c->inlined[k];
+                uint8_t ret_reg = lsp_get_arg1(c->jit->vm.state->funcs[f->f].instrs[f->pc]);
+                caller = build_exit_info(c, c->depth - k, f->f, f->pc + 1, f->regs, f->tags, ret_reg, caller);
+        }
+        LLVMValueRef exit = build_exit_info(c, 0, c->curr, pc, regs, tags, -1, caller);
+
+        // LspNativeValue lsp_jit_deopt(LspJit *jit, const LspSideExit *exit,
+        //                              LspNativeValue *values)
+        LLVMTypeRef deopt_params[3] = { ptr, ptr, LLVMPointerType(native_value_type(), 0) };
+        LLVMTypeRef deopt_type = LLVMFunctionType(native_value_type(), deopt_params, 3, 0);
+        LLVMValueRef deopt_args[3] = {
+                runtime_global(c->mod, "lsp_jit", LLVMInt8Type()),
+                exit,
+                c->spill,
+        };
+        LLVMValueRef deopt = runtime_fn(c->mod, "lsp_jit_deopt", deopt_type);
+        LLVMBuildRet(builder, LLVMBuildCall(builder, deopt, deopt_args, 3, ""));
+}
+
+/**
+ * Continues the trace only if `ok` holds, otherwise the interpreter takes over
+ * at `pc`.
+ */
+static void build_guard(TraceCompiler c[static 1],
+                        LLVMValueRef ok,
+                        uint64_t pc,
+                        LLVMValueRef regs[static UINT8_MAX + 1],
+                        LLVMValueRef tags[static UINT8_MAX + 1]) {
+        LLVMBuilderRef builder = c->builder;
+        LLVMBasicBlockRef guard_fail_bb = LLVMAppendBasicBlock(c->llvm_fn, "guard_fail");
+        LLVMBasicBlockRef guard_ok_bb = LLVMAppendBasicBlock(c->llvm_fn, "guard_ok");
+        LLVMValueRef br = LLVMBuildCondBr(builder, ok, guard_ok_bb, guard_fail_bb);
+        // guards are expected to hold, so their side exits are moved out of
+        // the way of the code that runs
+        LLVMValueRef weights[3] = {
+                LLVMMDString("branch_weights", 14),
+                LLVMConstInt(LLVMInt32Type(), 2000, 0),
+                LLVMConstInt(LLVMInt32Type(), 1, 0),
+        };
+        LLVMSetMetadata(br, LLVMGetMDKindID("prof", 4), LLVMMDNode(weights, 3));
+        LLVMPositionBuilderAtEnd(builder, guard_fail_bb);
+        build_side_exit(c, pc, regs, tags);
+        LLVMPositionBuilderAtEnd(builder, guard_ok_bb);
+}
+
+/**
+ * Makes sure register `r` holds a value of type `tag` from here on. Values whose
+ * type isn't known yet get a guard, which exits to the interpreter at `pc`.
+ */
+static void guard_tag(TraceCompiler c[static 1],
+                      uint8_t r,
+                      uint8_t tag,
+                      uint64_t pc,
+                      LLVMValueRef regs[static UINT8_MAX + 1],
+                      LLVMValueRef tags[static UINT8_MAX + 1]) {
+        if (LLVMIsAConstantInt(tags[r]) && LLVMConstIntGetZExtValue(tags[r]) == tag) {
+                return;
+        }
+        LLVMValueRef ok = LLVMBuildICmp(c->builder, LLVMIntEQ, tags[r], const_int(tag), "");
+        build_guard(c, ok, pc, regs, tags);
+        tags[r] = const_int(tag);
+}
+
+/**
+ * Builds `a` `op` `b`, where `op` is one of the `llvm.s*.with.overflow.i64`
+ * intrinsics. Results that don't fit in an int64 exit to the interpreter at
+ * `pc`, which redoes the instruction with a boxed integer.
+ */
+static LLVMValueRef build_checked(TraceCompiler c[static 1],
+                                  const char *op,
+                                  LLVMValueRef a,
+                                  LLVMValueRef b,
+                                  uint64_t pc,
+                                  LLVMValueRef regs[static UINT8_MAX + 1],
+                                  LLVMValueRef tags[static UINT8_MAX + 1]) {
+        LLVMTypeRef i64 = LLVMInt64Type();
+        LLVMTypeRef result_fields[2] = { i64, LLVMInt1Type() };
+        LLVMTypeRef params[2] = { i64, i64 };
+        LLVMTypeRef type = LLVMFunctionType(LLVMStructType(result_fields, 2, false), params, 2, 0);
+        LLVMValueRef args[2] = { a, b };
+        LLVMValueRef result = LLVMBuildCall(c->builder, runtime_fn(c->mod, op, type), args, 2, "");
+        LLVMValueRef overflow = LLVMBuildExtractValue(c->builder, result, 1, "");
+        build_guard(c, LLVMBuildNot(c->builder, overflow, ""), pc, regs, tags);
+        return LLVMBuildExtractValue(c->builder, result, 0, "");
+}
+
+/**
+ * Calls `callee` with the `nargs` values stored in the arguments of the trace.
+ *
+ * Self-recursion is a direct call. Other callees are called natively if their
+ * entry point is set by the time of the call, or through `lsp_jit_call`. Calls
+ * made past the stack limit always go through `lsp_jit_call`.
+ */
+static LLVMValueRef build_call(TraceCompiler c[static 1], LLVMValueRef callee, size_t nargs) {
+        LLVMBuilderRef builder = c->builder;
+        LLVMTypeRef i64 = LLVMInt64Type();
+        LLVMTypeRef ptr = LLVMPointerType(LLVMInt8Type(), 0);
+        LLVMTypeRef value_type = native_value_type();
+        bool self_call = LLVMIsAConstantInt(callee) && LLVMConstIntGetZExtValue(callee) == c->f;
+        LLVMBasicBlockRef lookup_bb = LLVMAppendBasicBlock(c->llvm_fn, "lookup");
+        LLVMBasicBlockRef entry_bb = LLVMAppendBasicBlock(c->llvm_fn, "entry");
+        LLVMBasicBlockRef native_bb = LLVMAppendBasicBlock(c->llvm_fn, "native");
+        LLVMBasicBlockRef interp_bb = LLVMAppendBasicBlock(c->llvm_fn, "interp");
+        LLVMBasicBlockRef done_bb = LLVMAppendBasicBlock(c->llvm_fn, "done");
+
+        LLVMValueRef stacksave = runtime_fn(c->mod, "llvm.stacksave", LLVMFunctionType(ptr, NULL, 0, 0));
+        LLVMValueRef sp = LLVMBuildPtrToInt(builder, LLVMBuildCall(builder, stacksave, NULL, 0, ""), i64, "");
+        LLVMValueRef limit = LLVMBuildLoad(builder, runtime_global(c->mod, "lsp_stack_limit", i64), "");
+        LLVMValueRef has_room = LLVMBuildICmp(builder, LLVMIntUGE, sp, limit, "");
+        LLVMBuildCondBr(builder, has_room, lookup_bb, interp_bb);
+
+        LLVMPositionBuilderAtEnd(builder, lookup_bb);
+        LLVMValueRef native_fn = c->llvm_fn;
+        if (self_call) {
+                LLVMBuildBr(builder, native_bb);
+                LLVMDeleteBasicBlock(entry_bb);
+        } else {
+                // lsp_jit_call reports bad function indices
+                size_t funcs = cvector_size(c->jit->entries);
+                LLVMValueRef in_bounds = LLVMBuildICmp(builder, LLVMIntULT, callee, const_int(funcs), "");
+                LLVMBuildCondBr(builder, in_bounds, entry_bb, interp_bb);
+
+                LLVMPositionBuilderAtEnd(builder, entry_bb);
+                LLVMValueRef entries = runtime_global(c->mod, "lsp_entries", LLVMArrayType(i64, 0));
+                LLVMValueRef is[2] = { const_int(0), callee };
+                LLVMValueRef entry = LLVMBuildLoad(builder, LLVMBuildGEP(builder, entries, is, 2, ""), "");
+                LLVMSetAlignment(entry, 8);
+                LLVMSetOrdering(entry, LLVMAtomicOrderingAcquire);
+                LLVMValueRef is_native = LLVMBuildICmp(builder, LLVMIntNE, entry, const_int(0), "");
+                LLVMBuildCondBr(builder, is_native, native_bb, interp_bb);
+                LLVMPositionBuilderAtEnd(builder, native_bb);
+                LLVMTypeRef native_type = LLVMGetElementType(LLVMTypeOf(c->llvm_fn));
+                native_fn = LLVMBuildIntToPtr(builder, entry, LLVMPointerType(native_type, 0), "");
+        }
+
+        LLVMPositionBuilderAtEnd(builder, native_bb);
+        LLVMValueRef native_ret = LLVMBuildCall(builder, native_fn, &c->args, 1, "");
+        LLVMBuildBr(builder, done_bb);
+
+        // LspNativeValue lsp_jit_call(LspJit *jit, int64_t fn, int64_t fn_tag,
+        //                             LspNativeValue *args, int64_t nargs)
+        LLVMPositionBuilderAtEnd(builder, interp_bb);
+        LLVMTypeRef call_params[5] = { ptr, i64, i64, LLVMPointerType(value_type, 0), i64 };
+        LLVMTypeRef call_type = LLVMFunctionType(value_type, call_params, 5, 0);
+        LLVMValueRef call_args[5] = {
+                runtime_global(c->mod, "lsp_jit", LLVMInt8Type()),
+                callee,
+                const_int(TAG_FN),
+                c->args,
+                const_int(nargs),
+        };
+        LLVMValueRef call = runtime_fn(c->mod, "lsp_jit_call", call_type);
+        LLVMValueRef interp_ret = LLVMBuildCall(builder, call, call_args, 5, "");
+        LLVMBuildBr(builder, done_bb);
+
+        LLVMPositionBuilderAtEnd(builder, done_bb);
+        LLVMValueRef ret = LLVMBuildPhi(builder, value_type, "");
+        LLVMValueRef incoming[2] = { native_ret, interp_ret };
+        LLVMBasicBlockRef incoming_bbs[2] = { native_bb, interp_bb };
+        LLVMAddIncoming(ret, incoming, incoming_bbs, 2);
+        return ret;
+}
+
+/**
+ * Jumps from the backward jump at `pc` to the header, with the parameters as
+ * they are now. Parameters whose type is known at the header must still have
+ * that type, or the interpreter takes the jump instead.
+ */
+static void build_loop_back(TraceCompiler c[static 1],
+                            uint64_t pc,
+                            LLVMValueRef regs[static UINT8_MAX + 1],
+                            LLVMValueRef tags[static UINT8_MAX + 1]) {
+        uint8_t params = c->jit->vm.state->funcs[c->f].num_of_params;
+        for (uint8_t i = 0; i < params; ++i) {
+                if (!LLVMIsAPHINode(c->header_tags[i])) {
+                        guard_tag(c, i, LLVMConstIntGetZExtValue(c->header_tags[i]), pc, regs, tags);
+                }
+        }
+        LLVMBasicBlockRef from = LLVMGetInsertBlock(c->builder);
+        for (uint8_t i = 0; i < params; ++i) {
+                LLVMAddIncoming(c->header_regs[i], &regs[i], &from, 1);
+                if (LLVMIsAPHINode(c->header_tags[i])) {
+                        LLVMAddIncoming(c->header_tags[i], &tags[i], &from, 1);
+                }
+        }
+        LLVMBuildBr(c->builder, c->header);
+}
+
+static void compile_path(TraceCompiler c[static 1],
+                         TraceNode *n,
+                         LLVMValueRef regs[static UINT8_MAX + 1],
+                         LLVMValueRef tags[static UINT8_MAX + 1]);
+
+/** The constant all incoming values of `phi` are, or `phi` itself. */
+static LLVMValueRef fold_phi(LLVMValueRef phi) {
+        unsigned n = LLVMCountIncoming(phi);
+        LLVMValueRef first = n > 0 ? LLVMGetIncomingValue(phi, 0) : NULL;
+        if (!first || !LLVMIsAConstantInt(first)) {
+                return phi;
+        }
+        // constants are unique
+        for (unsigned i = 1; i < n; ++i) {
+                if (LLVMGetIncomingValue(phi, i) != first) {
+                        return phi;
+                }
+        }
+        return first;
+}
+
+/**
+ * Compiles the call `n` by inlining the trace tree of its callee in its place,
+ * if the callee is known, can be inlined, and isn't already being inlined.
+ *
+ * \return Whether the call was inlined, in which case its result is in its
+ * register.
+ */
+static bool build_inlined(TraceCompiler c[static 1],
+                          TraceNode n[static 1],
+                          LLVMValueRef regs[static UINT8_MAX + 1],
+                          LLVMValueRef tags[static UINT8_MAX + 1]) {
+        LLVMBuilderRef builder = c->builder;
+        uint8_t r1 = lsp_get_arg1(n->instr), r2 = lsp_get_arg2(n->instr), r3 = lsp_get_arg3(n->instr);
+        if (c->depth == LSP_INLINE_DEPTH || !LLVMIsAConstantInt(regs[r2])) {
+                return false;
+        }
+        size_t g = LLVMConstIntGetZExtValue(regs[r2]);
+        LspState *state = c->jit->vm.state;
+        if (g >= cvector_size(state->funcs) || !c->trees[g]
+            || r3 - r2 != state->funcs[g].num_of_params) {
+                return false;
         }
+        // recursion would be inlined forever
+        bool recursive = g == c->curr;
+        for (size_t k = 0; k < c->depth; ++k) {
+                recursive |= g == c->inlined[k].f;
+        }
+        if (recursive) {
+                return false;
+        }
+
+        // the callee gets registers of its own, which start with the arguments
+        LLVMValueRef callee_regs[UINT8_MAX + 1] = { NULL };
+        LLVMValueRef callee_tags[UINT8_MAX + 1] = { NULL };
+        for (size_t r = r2 + 1; r <= r3; ++r) {
+                callee_regs[r - r2 - 1] = regs[r];
+                callee_tags[r - r2 - 1] = tags[r];
+        }
+        size_t curr = c->curr;
+        LLVMBasicBlockRef ret_bb = c->ret_bb;
+        LLVMValueRef ret_reg = c->ret_reg, ret_tag = c->ret_tag;
+        LLVMBasicBlockRef call_bb = LLVMGetInsertBlock(builder);
+        c->ret_bb = LLVMAppendBasicBlock(c->llvm_fn, "inlined_ret");
+        LLVMPositionBuilderAtEnd(builder, c->ret_bb);
+        c->ret_reg = LLVMBuildPhi(builder, LLVMInt64Type(), "");
+        c->ret_tag = LLVMBuildPhi(builder, LLVMInt64Type(), "");
+        LLVMPositionBuilderAtEnd(builder, call_bb);
+        c->inlined[c->depth++] = (InlineFrame){ .f = curr, .pc = n->pc, .regs = regs, .tags = tags };
+        c->curr = g;
+
+        // the root of the tree is the empty instruction every trace starts with
+        compile_path(c, c->trees[g]->children[0], callee_regs, callee_tags);
+        LLVMPositionBuilderAtEnd(builder, c->ret_bb);
+        regs[r1] = fold_phi(c->ret_reg);
+        tags[r1] = fold_phi(c->ret_tag);
 
-        // skip first instruction always
-        TraceNode *n = trace->head->children[0];
-        while (n) {
+        c->depth--;
+        c->curr = curr;
+        c->ret_bb = ret_bb;
+        c->ret_reg = ret_reg;
+        c->ret_tag = ret_tag;
+        return true;
+}
+
+/**
+ * Compiles the trace tree starting at `n`, from the current position of the
+ * builder.
+ *
+ * Registers are kept unboxed, along with their LspTag. Tags are constants
+ * wherever the type of a register is known, which is everywhere in traces
+ * that are type-stable, so that checking them costs nothing.
+ *
+ * \param `regs` The value of each register, or NULL if it doesn't have one yet.
+ * \param `tags` The type of each register.
+ */
+static void compile_path(TraceCompiler c[static 1],
+                         TraceNode *n,
+                         LLVMValueRef regs[static UINT8_MAX + 1],
+                         LLVMValueRef tags[static UINT8_MAX + 1]) {
+        LLVMBuilderRef builder = c->builder;
+        while (n && n->type == NODE_INSTR) {
+                TraceNode *next = n->children[0];
                 LspInstr i = n->instr;
                 uint8_t r1 = lsp_get_arg1(i);
                 switch (lsp_get_opcode(i)) {
                 case OP_LDC: {
-                        regs[r1] = const_int(self->vm.state->ints[lsp_get_arg2(i)]);
+                        regs[r1] = const_int(c->jit->vm.state->ints[lsp_get_long_arg(i)]);
+                        tags[r1] = const_int(TAG_INT);
                 } break;
                 case OP_ADD: {
                         uint8_t r2 = lsp_get_arg2(i), r3 = lsp_get_arg3(i);
-                        regs[r1] = LLVMBuildAdd(builder, regs[r2], regs[r3], "");
+                        guard_tag(c, r2, TAG_INT, n->pc, regs, tags);
+                        guard_tag(c, r3, TAG_INT, n->pc, regs, tags);
+                        regs[r1] = build_checked(c, "llvm.sadd.with.overflow.i64",
+                                                 regs[r2], regs[r3], n->pc, regs, tags);
+                        tags[r1] = const_int(TAG_INT);
                 } break;
                 case OP_SUB: {
                         uint8_t r2 = lsp_get_arg2(i), r3 = lsp_get_arg3(i);
-                        regs[r1] = LLVMBuildSub(builder, regs[r2], regs[r3], "");
+                        guard_tag(c, r2, TAG_INT, n->pc, regs, tags);
+                        guard_tag(c, r3, TAG_INT, n->pc, regs, tags);
+                        regs[r1] = build_checked(c, "llvm.ssub.with.overflow.i64",
+                                                 regs[r2], regs[r3], n->pc, regs, tags);
+                        tags[r1] = const_int(TAG_INT);
+                } break;
+                case OP_RET: {
+                        if (c->depth > 0) {
+                                // inlined functions return to their caller
+                                LLVMBasicBlockRef from = LLVMGetInsertBlock(builder);
+                                LLVMAddIncoming(c->ret_reg, &regs[r1], &from, 1);
+                                LLVMAddIncoming(c->ret_tag, &tags[r1], &from, 1);
+                                LLVMBuildBr(builder, c->ret_bb);
+                                break;
+                        }
+                        LLVMValueRef ret[2] = { regs[r1], tags[r1] };
+                        LLVMBuildAggregateRet(builder, ret, 2);
                 } break;
-                case OP_RET:
-                        LLVMBuildRet(builder, regs[r1]);
-                        break;
                 case OP_MOV: {
                         regs[r1] = regs[lsp_get_arg2(i)];
+                        tags[r1] = tags[lsp_get_arg2(i)];
                 } break;
                 case OP_EQ: {
+                        // values of different types are never equal
                         uint8_t r2 = lsp_get_arg2(i), r3 = lsp_get_arg3(i);
-                        LLVMValueRef cmp = LLVMBuildICmp(builder, LLVMIntEQ, regs[r2], regs[r3], "");
-                        regs[r1] = LLVMBuildIntCast(builder, cmp, LLVMInt64Type(), "");
+                        LLVMValueRef same = LLVMBuildICmp(builder, LLVMIntEQ, regs[r2], regs[r3], "");
+                        LLVMValueRef same_tag = LLVMBuildICmp(builder, LLVMIntEQ, tags[r2], tags[r3], "");
+                        LLVMValueRef eq = LLVMBuildAnd(builder, same, same_tag, "");
+                        regs[r1] = LLVMBuildZExt(builder, eq, LLVMInt64Type(), "");
+                        tags[r1] = const_int(TAG_INT);
                 } break;
                 case OP_CALL: {
-                        regs[r1] = LLVMBuildCall(builder, rf, NULL, 0, "");
+                        uint8_t r2 = lsp_get_arg2(i), r3 = lsp_get_arg3(i);
+                        guard_tag(c, r2, TAG_FN, n->pc, regs, tags);
+                        if (!build_inlined(c, n, regs, tags)) {
+                                for (size_t r = r2 + 1; r <= r3; ++r) {
+                                        store_native(c, c->args, r - r2 - 1, regs[r], tags[r]);
+                                }
+                                LLVMValueRef ret = build_call(c, regs[r2], r3 - r2);
+                                regs[r1] = LLVMBuildExtractValue(builder, ret, 0, "");
+                                tags[r1] = LLVMBuildExtractValue(builder, ret, 1, "");
+                        }
+                        // the rest of the trace relies on the type the call
+                        // was seen returning, if there was only one, and
+                        // leaves integers too big for it to the interpreter
+                        if (n->tag < LSP_TAG_UNSEEN) {
+                                guard_tag(c, r1, n->tag, n->pc + 1, regs, tags);
+                        } else {
+                                LLVMValueRef ok = LLVMBuildICmp(builder, LLVMIntNE, tags[r1],
+                                                                const_int(LSP_NATIVE_BIG), "");
+                                build_guard(c, ok, n->pc + 1, regs, tags);
+                        }
                 } break;
                 case OP_LDF: {
                         regs[r1] = const_int(lsp_get_arg2(i));
+                        tags[r1] = const_int(TAG_FN);
                 } break;
                 case OP_JMP:
+                        // only backward jumps are recorded, and they end
+                        // their trace
+                        build_loop_back(c, n->pc, regs, tags);
+                        break;
                 case OP_TEST: {
-                        // if (r1 == true/false) { guard_handler() }
-                        LLVMValueRef val = const_int(n->metadata == NODE_MD_TRUE ? 1 : 0);
-                        LLVMValueRef cmp = LLVMBuildICmp(builder, LLVMIntEQ, regs[r1], val, "");
-                        LLVMBasicBlockRef guard_fail_bb = LLVMAppendBasicBlock(llvm_fn, "guard_fail");
-                        LLVMBasicBlockRef guard_ok_bb = LLVMAppendBasicBlock(llvm_fn, "guard_ok");
-                        LLVMBuildCondBr(builder, cmp, guard_fail_bb, guard_ok_bb);
-                        LLVMPositionBuilderAtEnd(builder, guard_fail_bb);
-                        LLVMBuildCall(builder, guard_fn, NULL, 0, "");
-                        LLVMBuildRet(builder, const_int(0));
-                        LLVMPositionBuilderAtEnd(builder, guard_ok_bb);
+                        // the true path is on the left, the false one on the
+                        // right
+                        TraceNode *t = n->children[0], *e = n->children[1];
+                        // functions are always true
+                        LLVMValueRef is_fn = LLVMBuildICmp(builder, LLVMIntEQ, tags[r1], const_int(TAG_FN), "");
+                        LLVMValueRef non_zero = LLVMBuildICmp(builder, LLVMIntNE, regs[r1], const_int(0), "");
+                        LLVMValueRef cmp = LLVMBuildOr(builder, is_fn, non_zero, "");
+                        if (t && e) {
+                                LLVMBasicBlockRef then_bb = LLVMAppendBasicBlock(c->llvm_fn, "then");
+                                LLVMBasicBlockRef else_bb = LLVMAppendBasicBlock(c->llvm_fn, "else");
+                                LLVMBuildCondBr(builder, cmp, then_bb, else_bb);
+                                // both paths start from the same registers
+                                LLVMValueRef then_regs[UINT8_MAX + 1];
+                                LLVMValueRef then_tags[UINT8_MAX + 1];
+                                memcpy(then_regs, regs, sizeof(then_regs));
+                                memcpy(then_tags, tags, sizeof(then_tags));
+                                LLVMPositionBuilderAtEnd(builder, then_bb);
+                                compile_path(c, t, then_regs, then_tags);
+                                LLVMPositionBuilderAtEnd(builder, else_bb);
+                                next = e;
+                                break;
+                        }
+                        // only one direction was ever taken, so the other one
+                        // becomes a guard: the interpreter evaluates the test
+                        // again, and takes the other branch
+                        if (!t) {
+                                cmp = LLVMBuildNot(builder, cmp, "");
+                                next = e;
+                        }
+                        build_guard(c, cmp, n->pc, regs, tags);
                 } break;
                 }
-                n = n->children[0];
+                n = next;
         }
-        self->compiled_funcs[f] = llvm_fn;
+}
+
+/** The name of the native code of `func`, which has the cache key `key`. */
+static char* native_name(const LspFunc func[static 1], uint64_t key) {
+        char *name = lsp_malloc(strlen(func->name) + 18);
+        sprintf(name, "%s.%016lx", func->name, key);
+        return name;
+}
+
+void lsp_jit_load_cache(LspJit self[static 1]) {
+        double start = lsp_now();
+        LspState *state = self->vm.state;
+        for (size_t f = 1; self->opts.enabled && f < cvector_size(state->funcs); ++f) {
+                uint64_t key = lsp_cache_key(state, f, self->opts.opt_level, LSP_INLINE_DEPTH);
+                LLVMModuleRef mod = lsp_cache_load(&self->cache, key);
+                if (!mod) {
+                        continue;
+                }
+                char *name = native_name(&state->funcs[f], key);
+                link_runtime(self, mod);
+                LLVMAddModule(self->engine, mod);
+                LspNativeFn native = (LspNativeFn)LLVMGetFunctionAddress(self->engine, name);
+                free(name);
+                atomic_store_explicit(&self->entries[f], native, memory_order_release);
+                if (native) {
+                        lsp_tiering_promote(&self->tiering, f, LSP_FN_OPTIMIZED);
+                }
+        }
+        self->cache.load_time = lsp_now() - start;
+}
+
+/**
+ * Compiles the trace tree of the function at `f`.
+ *
+ * \param `param_tags` The types the function was called with. Parameters that
+ * always had the same type are guarded once, on entry.
+ * \param `inline_trees` The trace trees of the functions that can be inlined,
+ * see `inline_trees`.
+ */
+static void compile_trace(LspJit self[static 1],
+                          size_t f,
+                          TraceNode tree[static 1],
+                          const uint8_t *param_tags,
+                          TraceNode **inline_trees) {
+        double start = lsp_now();
+        LspFunc *func = &self->vm.state->funcs[f];
+        // LspNativeValue f(LspNativeValue *params)
+        LLVMTypeRef value_type = native_value_type();
+        LLVMTypeRef param_type[1] = { LLVMPointerType(value_type, 0) };
+        LLVMTypeRef ret_type = LLVMFunctionType(value_type, param_type, 1, 0);
+        // MCJIT code-generates a module only once, so every function gets a
+        // module of its own, and a name that no other module uses
+        uint64_t key = lsp_cache_key(self->vm.state, f, self->opts.opt_level, LSP_INLINE_DEPTH);
+        char *name = native_name(func, key);
+        LLVMModuleRef mod = LLVMModuleCreateWithName(name);
+        LLVMValueRef llvm_fn = LLVMAddFunction(mod, name, ret_type);
+
+        LLVMBasicBlockRef entry = LLVMAppendBasicBlock(llvm_fn, "entry");
+        LLVMBuilderRef builder = LLVMCreateBuilder();
+        LLVMPositionBuilderAtEnd(builder, entry);
+        TraceCompiler c = {
+                .jit = self,
+                .builder = builder,
+                .mod = mod,
+                .llvm_fn = llvm_fn,
+                .f = f,
+                .trees = inline_trees,
+                .curr = f,
+                .depth = 0,
+                .ret_bb = NULL,
+                .ret_reg = NULL,
+                .ret_tag = NULL,
+                .args = LLVMBuildArrayAlloca(builder, value_type, const_int(UINT8_MAX), "args"),
+                .spill = LLVMBuildArrayAlloca(builder, value_type,
+                                              const_int((UINT8_MAX + 1) * (LSP_INLINE_DEPTH + 1)),
+                                              "spill"),
+        };
+
+        LLVMValueRef params = LLVMGetParam(llvm_fn, 0);
+        LLVMValueRef regs[UINT8_MAX + 1] = { NULL };
+        LLVMValueRef tags[UINT8_MAX + 1] = { NULL };
+        for (uint8_t i = 0; i < func->num_of_params; ++i) {
+                LLVMValueRef v_is[2] = { const_int(i), LLVMConstInt(LLVMInt32Type(), 0, 0) };
+                regs[i] = LLVMBuildLoad(builder, LLVMBuildInBoundsGEP(builder, params, v_is, 2, ""), "");
+                LLVMValueRef tag_is[2] = { const_int(i), LLVMConstInt(LLVMInt32Type(), 1, 0) };
+                tags[i] = LLVMBuildLoad(builder, LLVMBuildInBoundsGEP(builder, params, tag_is, 2, ""), "");
+        }
+        for (uint8_t i = 0; i < func->num_of_params; ++i) {
+                if (param_tags[i] < LSP_TAG_UNSEEN) {
+                        guard_tag(&c, i, param_tags[i], 0, regs, tags);
+                }
+        }
+        // loops jump back to the header, where the parameters are phis
+        c.header = LLVMAppendBasicBlock(llvm_fn, "header");
+        LLVMBasicBlockRef from = LLVMGetInsertBlock(builder);
+        LLVMBuildBr(builder, c.header);
+        LLVMPositionBuilderAtEnd(builder, c.header);
+        for (uint8_t i = 0; i < func->num_of_params; ++i) {
+                c.header_regs[i] = LLVMBuildPhi(builder, LLVMInt64Type(), "");
+                LLVMAddIncoming(c.header_regs[i], &regs[i], &from, 1);
+                regs[i] = c.header_regs[i];
+                if (LLVMIsAConstantInt(tags[i])) {
+                        c.header_tags[i] = tags[i];
+                        continue;
+                }
+                c.header_tags[i] = LLVMBuildPhi(builder, LLVMInt64Type(), "");
+                LLVMAddIncoming(c.header_tags[i], &tags[i], &from, 1);
+                tags[i] = c.header_tags[i];
+        }
+
+        // the root of the tree is the empty instruction every trace starts with
+        compile_path(&c, tree->children[0], regs, tags);
         LLVMDisposeBuilder(builder);
-        LLVMDumpModule(self->module);
+        if (LLVMVerifyFunction(llvm_fn, LLVMPrintMessageAction)) {
+                LLVMDumpValue(llvm_fn);
+                printf("Invalid IR generated for %s.\n", func->name);
+                exit(1);
+        }
+        LLVMRunPassManager(self->passes, mod);
+        if (self->opts.dump_ir) {
+                LLVMDumpValue(llvm_fn);
+        }
+        lsp_cache_store(&self->cache, key, mod);
+        // functions that leave their code too often are compiled again, and
+        // the engine needs a new name for every version of them, while the
+        // cache keeps the name the next run looks for
+        char *version = lsp_malloc(strlen(name) + 22);
+        sprintf(version, "%s.%ld", name, self->compiled);
+        LLVMSetValueName(llvm_fn, version);
+        // the engine owns the module from now on, and resolving the address
+        // generates its code
+        link_runtime(self, mod);
+        LLVMAddModule(self->engine, mod);
+        LspNativeFn native = (LspNativeFn)LLVMGetFunctionAddress(self->engine, version);
+        free(version);
+        free(name);
+        // the code must be visible to the interpreter before the entry is
+        atomic_store_explicit(&self->entries[f], native, memory_order_release);
+        if (self->compiler_started) {
+                pthread_mutex_lock(&self->lock);
+        }
+        self->compiled++;
+        self->compile_time += lsp_now() - start;
+        if (self->compiler_started) {
+                pthread_mutex_unlock(&self->lock);
+        }
+}
+
+/**
+ * The trace trees of the functions that can be inlined into compiled code, by
+ * function, or NULL for the others. These are small functions without loops,
+ * which were recorded.
+ *
+ * \param `clone` Whether the trees are copies, for the compiler thread.
+ */
+static TraceNode** inline_trees(LspJit self[static 1], bool clone) {
+        LspState *state = self->vm.state;
+        size_t funcs = cvector_size(state->funcs);
+        TraceNode **trees = lsp_malloc(funcs * sizeof(TraceNode*));
+        for (size_t g = 0; g < funcs; ++g) {
+                trees[g] = NULL;
+                LspFunc *fn = &state->funcs[g];
+                bool small = g > 0 && cvector_size(fn->instrs) <= LSP_INLINE_SIZE;
+                for (size_t pc = 0; small && pc < cvector_size(fn->instrs); ++pc) {
+                        if (lsp_get_opcode(fn->instrs[pc]) == OP_JMP && lsp_get_offset(fn->instrs[pc]) <= 0) {
+                                small = false;
+                        }
+                }
+                TraceNode *tree = small ? lsp_trace_map_get(&self->traces, g) : NULL;
+                trees[g] = tree && clone ? lsp_trace_node_clone(tree) : tree;
+        }
+        return trees;
+}
+
+/** Frees what `inline_trees` returned. */
+static void free_inline_trees(LspJit self[static 1], TraceNode **trees, bool cloned) {
+        for (size_t g = 0; cloned && g < cvector_size(self->vm.state->funcs); ++g) {
+                if (trees[g]) {
+                        lsp_trace_node_free(trees[g]);
+                        free(trees[g]);
+                }
+        }
+        free(trees);
+}
+
+/** Compiles the jobs of the queue, until the JIT is freed. */
+static void* compile_loop(void *arg) {
+        LspJit *self = arg;
+        pthread_mutex_lock(&self->lock);
+        for (;;) {
+                while (cvector_size(self->jobs) == 0 && !self->compiler_stopping) {
+                        pthread_cond_wait(&self->jobs_ready, &self->lock);
+                }
+                if (self->compiler_stopping) {
+                        break;
+                }
+                LspCompileJob job = self->jobs[0];
+                cvector_erase(self->jobs, 0);
+                pthread_mutex_unlock(&self->lock);
+                compile_trace(self, job.f, job.tree, job.param_tags, job.inline_trees);
+                lsp_trace_node_free(job.tree);
+                free(job.tree);
+                free(job.param_tags);
+                free_inline_trees(self, job.inline_trees, true);
+                pthread_mutex_lock(&self->lock);
+        }
+        pthread_mutex_unlock(&self->lock);
+        return NULL;
+}
+
+/**
+ * Queues the function at `f` for compilation. Until it is compiled, calls keep
+ * being interpreted.
+ */
+static void queue_compile(LspJit self[static 1], size_t f, TraceNode tree[static 1]) {
+        // the JIT doesn't move once the program runs, so the thread can
+        // only be started now
+        if (!self->compiler_started) {
+                pthread_mutex_init(&self->lock, NULL);
+                pthread_cond_init(&self->jobs_ready, NULL);
+                if (pthread_create(&self->compiler, NULL, compile_loop, self)) {
+                        printf("Failed to start the compiler thread.\n");
+                        exit(1);
+                }
+                self->compiler_started = true;
+        }
+        // the tree keeps changing as more traces are recorded
+        size_t params = self->vm.state->funcs[f].num_of_params;
+        LspCompileJob job = {
+                .f = f,
+                .tree = lsp_trace_node_clone(tree),
+                .param_tags = lsp_malloc(params + 1),
+                .inline_trees = inline_trees(self, true),
+        };
+        memcpy(job.param_tags, self->param_tags[f], params);
+        pthread_mutex_lock(&self->lock);
+        cvector_push_back(self->jobs, job);
+        pthread_cond_signal(&self->jobs_ready);
+        pthread_mutex_unlock(&self->lock);
+}
+
+void lsp_jit_stop_compiler(LspJit self[static 1]) {
+        if (!self->compiler_started) {
+                return;
+        }
+        pthread_mutex_lock(&self->lock);
+        self->compiler_stopping = true;
+        pthread_cond_signal(&self->jobs_ready);
+        pthread_mutex_unlock(&self->lock);
+        pthread_join(self->compiler, NULL);
+        for (size_t i = 0; i < cvector_size(self->jobs); ++i) {
+                lsp_trace_node_free(self->jobs[i].tree);
+                free(self->jobs[i].tree);
+                free(self->jobs[i].param_tags);
+                free_inline_trees(self, self->jobs[i].inline_trees, true);
+        }
+        cvector_free(self->jobs);
+        pthread_cond_destroy(&self->jobs_ready);
+        pthread_mutex_destroy(&self->lock);
+        self->compiler_started = false;
+}
+
+/** Whether hot functions go through the baseline compiler. */
+static bool uses_baseline(const LspJit self[static 1]) {
+        return self->opts.tiering.baseline_at > 0 && lsp_baseline_supported();
+}
+
+/** Whether hot functions end up optimized by LLVM. */
+static bool uses_llvm(const LspJit self[static 1]) {
+        return self->opts.tier == LSP_TIER_LLVM || !lsp_baseline_supported();
+}
+
+/** Hands the function at `f` to LLVM, along with the traces recorded so far. */
+static void optimize(LspJit self[static 1], size_t f) {
+        lsp_tiering_promote(&self->tiering, f, LSP_FN_OPTIMIZED);
+        TraceNode *tree = lsp_trace_map_get(&self->traces, f);
+        if (self->opts.background) {
+                // functions that went back to the interpreter to be recorded
+                // run their baseline code again until LLVM is done, which
+                // only publishes its code after this
+                void *baseline = lsp_baseline_entry(&self->baseline, f);
+                if (baseline) {
+                        atomic_store_explicit(&self->entries[f],
+                                              (LspNativeFn)(uintptr_t)baseline,
+                                              memory_order_release);
+                }
+                queue_compile(self, f, tree);
+        } else {
+                TraceNode **trees = inline_trees(self, false);
+                compile_trace(self, f, tree, self->param_tags[f], trees);
+                free_inline_trees(self, trees, false);
+        }
+}
+
+/** Sends the function at `f` to the baseline compiler, if it is hot enough. */
+static void try_baseline(LspJit self[static 1], size_t f) {
+        LspTiering *tiering = &self->tiering;
+        if (uses_baseline(self) && lsp_tiering_wants_baseline(tiering, f)) {
+                // this is fast enough to not get in the way
+                lsp_tiering_promote(tiering, f, LSP_FN_BASELINE);
+                lsp_baseline_compile(self, f);
+        }
+}
+
+/**
+ * Counts a call to the function at `f` that is about to be interpreted, which
+ * may send the function to the baseline compiler.
+ */
+static void count_call(LspJit self[static 1], size_t f) {
+        if (!self->opts.enabled) {
+                return;
+        }
+        self->tiering.hotness[f]++;
+        try_baseline(self, f);
+}
+
+void lsp_jit_tier_up(LspJit *jit, int64_t f) {
+        LspTiering *tiering = &jit->tiering;
+        if (tiering->tiers[f] != LSP_FN_BASELINE) {
+                return;
+        }
+        if (lsp_tiering_is_stable(tiering, f)) {
+                optimize(jit, f);
+                return;
+        }
+        // the baseline code stays around for the frames that are still
+        // running it, but new calls are interpreted
+        atomic_store_explicit(&jit->entries[f], NULL, memory_order_release);
+        lsp_tiering_promote(tiering, f, LSP_FN_PROFILING);
+}
+
+/**
+ * Adds the trace `list` to the traces of the function at `func`, which may get
+ * the function optimized.
+ */
+static void merge_trace(LspJit self[static 1], size_t func, TraceList list[static 1]) {
+        // list deallocation is handled by the map
+        size_t recorded = lsp_trace_map_insert(&self->traces, func, list);
+        LspTiering *tiering = &self->tiering;
+        if (recorded > tiering->stable[func]) {
+                tiering->stable[func] = recorded;
+        }
+        if (uses_llvm(self) && lsp_tiering_wants_optimized(tiering, func)) {
+                optimize(self, func);
+        }
+        lsp_trace_list_free(list);
 }
 
 void lsp_jit_trace_end(LspJit self[static 1], size_t func) {
         size_t last = cvector_size(self->open_traces);
-        if (last == 0 || func == 0) {
+        if (!self->opts.enabled || last == 0 || func == 0) {
                 return;
         }
         TraceList list = self->open_traces[last - 1];
         cvector_pop_back(self->open_traces);
-        // list deallocation is handled by the map
-        bool is_hot = lsp_trace_map_insert(&self->traces, func, &list);
-        if (is_hot && !self->compiled_funcs[func]) {
-                compile_trace(self, func, &list);
+        if (list.head) {
+                lsp_tiering_returned(&self->tiering, func);
+                merge_trace(self, func, &list);
+        }
+}
+
+static LspValue interpret(LspJit *self, const void *const **handlers);
+
+static cvector_vector_type(cvector_vector_type(LspDecoded)) decode_funcs(LspState state[static 1],
+                                                                         bool recording) {
+        const void *const *handlers;
+        interpret(NULL, &handlers);
+        cvector_vector_type(cvector_vector_type(LspDecoded)) code = NULL;
+        for (size_t f = 0; f < cvector_size(state->funcs); ++f) {
+                cvector_push_back(code, lsp_decode_func(state, &state->funcs[f], recording, handlers));
+        }
+        return code;
+}
+
+static void free_code(cvector_vector_type(cvector_vector_type(LspDecoded)) code) {
+        for (size_t f = 0; f < cvector_size(code); ++f) {
+                lsp_free_decoded(code[f]);
         }
-        lsp_trace_list_free(&list);
+        cvector_free(code);
 }
 
 LspVm lsp_new_vm(LspState state[static 1]) {
-        cvector_vector_type(LspValue) regs = NULL;
-        for (size_t i = 0; i < 256; ++i) {
-                cvector_push_back(regs, 0);
+        // the interpreter trusts the opcodes it dispatches on
+        for (size_t f = 0; f < cvector_size(state->funcs); ++f) {
+                LspFunc *fn = &state->funcs[f];
+                for (size_t i = 0; i < cvector_size(fn->instrs); ++i) {
+                        if (lsp_get_opcode(fn->instrs[i]) >= LSP_NUM_OPCODES) {
+                                printf("Not implemented yet...\n");
+                                exit(1);
+                        }
+                }
         }
         LspVm vm = {
                 .regs_start = 0,
-                .regs = regs,
+                .regs = lsp_reserve(LSP_MAX_REGS * sizeof(LspValue)),
+                .regs_top = state->funcs[0].regs_in_use,
+                .regs_capacity = LSP_MAX_REGS,
                 .pc = 0,
                 .state = state,
                 .curr_fn = 0,
+                .arena = lsp_arena_new(),
+                .frames = NULL,
+                .gc = lsp_gc_new(),
+                .executed = 0,
+                .code = decode_funcs(state, false),
+                .recording_code = decode_funcs(state, true),
         };
         return vm;
 }
 
 void lsp_cleanup_vm(LspVm vm[static 1]) {
-        for (size_t i = 0; i < cvector_size(vm->regs); ++i) {
-                lsp_free_val(vm->regs[i]);
-        }
-        cvector_free(vm->regs);
+        lsp_arena_free(&vm->arena);
+        cvector_free(vm->frames);
+        lsp_unreserve(vm->regs, vm->regs_capacity * sizeof(LspValue));
+        free_code(vm->code);
+        free_code(vm->recording_code);
 }
 
-static LspValue add(LspValue v1, LspValue v2) {
+static LspValue add(LspArena arena[static 1], LspValue v1, LspValue v2) {
+        // small integers are added while tagged: (2a + 1) + 2b = 2(a + b) + 1,
+        // which overflows an int64 exactly when a + b doesn't fit in 63 bits
+        int64_t sum;
+        if ((v1 & v2 & 1) && !__builtin_add_overflow((int64_t)v1, (int64_t)v2 - 1, &sum)) {
+                return (LspValue)sum;
+        }
         assert(lsp_get_tag(v1) == TAG_INT);
         assert(lsp_get_tag(v2) == TAG_INT);
-        int64_t n1 = *lsp_get_number(v1);
-        int64_t n2 = *lsp_get_number(v2);
-        return lsp_new_number(n1 + n2);
+        return lsp_big_add(arena, v1, v2);
 }
 
-static LspValue sub(LspValue v1, LspValue v2) {
+static LspValue sub(LspArena arena[static 1], LspValue v1, LspValue v2) {
+        // (2a + 1) - (2b + 1) = 2(a - b)
+        int64_t diff;
+        if ((v1 & v2 & 1) && !__builtin_sub_overflow((int64_t)v1, (int64_t)v2, &diff)) {
+                return (LspValue)diff | 1;
+        }
         assert(lsp_get_tag(v1) == TAG_INT);
         assert(lsp_get_tag(v2) == TAG_INT);
-        int64_t n1 = *lsp_get_number(v1);
-        int64_t n2 = *lsp_get_number(v2);
-        return lsp_new_number(n1 - n2);
+        return lsp_big_sub(arena, v1, v2);
 }
 
 static LspValue eq(LspValue v1, LspValue v2) {
+        if (lsp_is_small(v1) && lsp_is_small(v2)) {
+                return lsp_new_small(v1 == v2);
+        }
         LspTag t1 = lsp_get_tag(v1);
         assert(t1 == lsp_get_tag(v2));
         if (t1 == TAG_INT) {
-                int64_t n1 = *lsp_get_number(v1);
-                int64_t n2 = *lsp_get_number(v2);
-                return lsp_new_number(n1 == n2);
+                return lsp_new_small(lsp_big_eq(v1, v2));
         }
-        return lsp_new_number(v1 == v2);
+        return lsp_new_small(v1 == v2);
 }
 
-inline static size_t create_stack_frame(LspVm vm[static 1], size_t end, size_t new_len) {
-        if (new_len == 0) {
-                printf("Bad new_len\n");
+inline static size_t push_stack_frame(LspVm vm[static 1], size_t len) {
+        size_t top = vm->regs_top;
+        if (len > vm->regs_capacity - top) {
+                printf("Stack overflow.\n");
                 exit(1);
         }
-        size_t regs_len = cvector_size(vm->regs);
-        size_t new_regs = 0;
-        if (end >= regs_len) {
-                new_regs = new_len + end - regs_len;
-        } else {
-                size_t diff = regs_len - end;
-                if (new_len > diff) {
-                        new_regs = new_len - diff;
+        vm->regs_top = top + len;
+        return top;
+}
+
+/**
+ * The entry point of the function at `fn_index`, if it is compiled and there is
+ * room for it on the native stack. The interpreter, which has a stack of its
+ * own, runs calls that recurse deeper.
+ */
+static LspNativeFn native_entry(LspJit jit[static 1], size_t fn_index) {
+        char here;
+        if ((uintptr_t)&here < jit->stack_limit) {
+                return NULL;
+        }
+        return atomic_load_explicit(&jit->entries[fn_index], memory_order_acquire);
+}
+
+/** Whether compiled code can work with `v`, without a LSP_NATIVE_BIG. */
+static bool fits_native(LspValue v) {
+        int64_t n;
+        return lsp_get_tag(v) == TAG_FN || lsp_get_int64(v, &n);
+}
+
+/**
+ * The value compiled code works with, for `v`. Integers that don't fit in an
+ * int64 are kept by the JIT until `from_native` takes them back.
+ */
+static LspNativeValue to_native(LspJit jit[static 1], LspValue v) {
+        LspNativeValue n = { .v = 0, .tag = lsp_get_tag(v) };
+        if (n.tag == TAG_FN) {
+                n.v = lsp_get_fn(v);
+        } else if (!lsp_get_int64(v, &n.v)) {
+                free(jit->native_big);
+                jit->native_big = lsp_dup_box(lsp_get_box(v));
+                n.tag = LSP_NATIVE_BIG;
+        }
+        return n;
+}
+
+/** The VM value for `n`, which came from compiled code. */
+static LspValue from_native(LspJit jit[static 1], LspNativeValue n) {
+        switch (n.tag) {
+        case TAG_FN:
+                return lsp_new_fn(n.v);
+        case LSP_NATIVE_BIG:
+                return lsp_copy_box(&jit->vm.arena, jit->native_big);
+        default:
+                return lsp_new_number(&jit->vm.arena, n.v);
+        }
+}
+
+/**
+ * Records the types of the parameters of the current frame, which was just
+ * entered and starts at `top`.
+ */
+static void record_params(LspJit jit[static 1], size_t top) {
+        size_t last = cvector_size(jit->open_traces);
+        if (last == 0 || !jit->open_traces[last - 1].head) {
+                return;
+        }
+        LspVm *vm = &jit->vm;
+        uint8_t *tags = jit->param_tags[vm->curr_fn];
+        for (uint8_t i = 0; i < vm->state->funcs[vm->curr_fn].num_of_params; ++i) {
+                tags[i] = lsp_merge_tag(tags[i], lsp_get_tag(vm->regs[top + i]));
+        }
+}
+
+
+
+/**
+ * Moves the current frame into the compiled code of its function, if there is
+ * any, as it starts another iteration of a loop. Loops jump back to the start
+ * of their function, where only the parameters are live, so the compiled code
+ * is entered as if the function was called with them.
+ *
+ * \return Whether the compiled code ran the rest of the frame, in which case
+ * `ret` is the value it returned.
+ */
+static bool enter_native(LspJit jit[static 1], LspValue ret[static 1]) {
+        LspVm *vm = &jit->vm;
+        LspNativeFn native = native_entry(jit, vm->curr_fn);
+        LspValue *fp = &vm->regs[vm->regs_start];
+        uint8_t params = vm->state->funcs[vm->curr_fn].num_of_params;
+        for (uint8_t i = 0; native && i < params; ++i) {
+                if (!fits_native(fp[i])) {
+                        native = NULL;
                 }
         }
-        for (size_t i = 0; i < new_regs; ++i) {
-                cvector_push_back(vm->regs, 0);
+        if (!native) {
+                return false;
+        }
+        LspNativeValue values[UINT8_MAX];
+        for (uint8_t i = 0; i < params; ++i) {
+                values[i] = to_native(jit, fp[i]);
         }
-        return end;
+        jit->osr_entries++;
+        *ret = from_native(jit, native(values));
+        return true;
 }
 
-inline static int interpret_call(LspJit jit[static 1], LspInstr i) {
+/**
+ * Takes the backward jump the current frame is at, which starts another
+ * iteration of a loop.
+ *
+ * The trace of the frame ends at the jump, and the next one records the next
+ * iteration. Loops count towards the hotness of their function like calls do,
+ * so they are compiled even if the function is only called once, and they
+ * continue in the compiled code as soon as there is some.
+ *
+ * \return Whether compiled code ran the rest of the frame, in which case `ret`
+ * is the value it returned.
+ */
+static bool back_edge(LspJit jit[static 1], LspValue ret[static 1]) {
         LspVm *vm = &jit->vm;
+        size_t f = vm->curr_fn;
+        jit->tiering.hotness[f]++;
+        // loops only allocate in their frame, so they collect garbage as they
+        // go
+        lsp_gc_safepoint(vm);
+        if (!jit->opts.enabled) {
+                return false;
+        }
+        TraceList *list = &jit->open_traces[cvector_size(jit->open_traces) - 1];
+        if (list->head) {
+                merge_trace(jit, f, list);
+                list->head = NULL;
+                list->tail = NULL;
+        }
+        try_baseline(jit, f);
+        if (enter_native(jit, ret)) {
+                return true;
+        }
+        // frames that started in the middle of their function record from
+        // here on too
+        if (lsp_tiering_records(&jit->tiering, f)) {
+                list = &jit->open_traces[cvector_size(jit->open_traces) - 1];
+                *list = lsp_trace_list_new(lsp_trace_node_new(0, 0, NODE_MD_NONE));
+                record_params(jit, vm->regs_start);
+        }
+        return false;
+}
 
-        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-        uint8_t r2 = lsp_get_arg2(i) + vm->regs_start;
-        LspValue v2 = vm->regs[r2];
-        if (lsp_get_tag(v2) != TAG_FN) {
+/**
+ * Records the type of `v`, which was just returned to the call the open trace
+ * ends with.
+ */
+static void record_result(LspJit jit[static 1], LspValue v) {
+        size_t last = cvector_size(jit->open_traces);
+        if (last == 0) {
+                return;
+        }
+        TraceList *trace = &jit->open_traces[last - 1];
+        if (trace->tail && trace->tail != trace->head && lsp_get_opcode(trace->tail->instr) == OP_CALL) {
+                trace->tail->tag = lsp_merge_tag(trace->tail->tag, lsp_get_tag(v));
+        }
+}
+
+/**
+ * Opens the trace of a new frame of the function at `fn_index`. Functions that
+ * were compiled aren't recorded anymore.
+ */
+static void open_trace(LspJit jit[static 1], size_t fn_index) {
+        if (jit->opts.enabled && !lsp_tiering_records(&jit->tiering, fn_index)) {
+                skip_trace(jit);
+        } else {
+                lsp_jit_trace_start(jit);
+        }
+}
+
+/**
+ * Pushes a frame for the function at `fn_index`, and makes it current. The
+ * trace of the new frame must already be open, and its parameters are left for
+ * the caller to fill in.
+ *
+ * \param `resume_pc` The pc the caller continues from once the frame is popped.
+ * \param `ret_reg` The register of the caller the return value goes into.
+ * \return Where the registers of the new frame start.
+ */
+static size_t enter_frame(LspJit jit[static 1],
+                          size_t fn_index,
+                          uint64_t resume_pc,
+                          uint8_t ret_reg,
+                          bool native_caller) {
+        LspVm *vm = &jit->vm;
+        lsp_gc_safepoint(vm);
+        // all registers above the top of the stack are cleared, so the new
+        // frame is ready to use
+        size_t old_regs_top = vm->regs_top;
+        size_t top = push_stack_frame(vm, vm->state->funcs[fn_index].regs_in_use);
+        LspFrame frame = {
+                .regs_start = top,
+                .mark = lsp_arena_mark(&vm->arena),
+                .caller_fn = vm->curr_fn,
+                .caller_pc = resume_pc,
+                .caller_regs_start = vm->regs_start,
+                .caller_regs_top = old_regs_top,
+                .ret_reg = ret_reg,
+                .native_caller = native_caller,
+        };
+        cvector_push_back(vm->frames, frame);
+
+        vm->pc = 0;
+        vm->curr_fn = fn_index;
+        vm->regs_start = top;
+        return top;
+}
+
+/**
+ * Finds the callee `v` of the call `d` in the polymorphic part of its inline
+ * cache. Callees that aren't there yet are checked, and added if there is room.
+ *
+ * \return The index of the callee.
+ */
+static size_t resolve_callee(LspJit jit[static 1], const LspDecoded d[static 1], LspValue v) {
+        LspCallCache *cache = d->cache;
+        for (uint8_t i = 1; i < cache->len; ++i) {
+                if (cache->callees[i] == v) {
+                        cache->hits++;
+                        return lsp_get_fn(v);
+                }
+        }
+        cache->misses++;
+        if (lsp_get_tag(v) != TAG_FN) {
                 printf("Not a function.\n");
                 exit(1);
         }
-
-        uint8_t r3 = lsp_get_arg3(i) + vm->regs_start;
-        uint8_t fn_index = lsp_get_fn(v2);
-        if (fn_index > cvector_size(vm->state->funcs)) {
+        size_t fn_index = lsp_get_fn(v);
+        if (fn_index >= cvector_size(jit->vm.state->funcs)) {
                 printf("Function index oob.\n");
                 exit(1);
         }
-        LspFunc *fn = &vm->state->funcs[fn_index];
-        if (r3 <= r2 || r3 - r2 - 1 > fn->num_of_params) {
+        LspFunc *fn = &jit->vm.state->funcs[fn_index];
+        if (d->c <= d->b || d->c - d->b - 1 > fn->num_of_params) {
                 printf("Function was expecting %d args, found %d.\n",
                        fn->num_of_params,
-                       r3 - r2- 1);
+                       d->c - d->b - 1);
                 exit(1);
         }
-
-        LLVMValueRef func = jit->compiled_funcs[fn_index];
-        if (func) {
-                int64_t *params = lsp_malloc(sizeof(int64_t) * fn->num_of_params);
-                for (uint8_t r = r2 + 1; r < r3; ++r) {
-                        params[i] = *lsp_get_number(vm->regs[r]);
-                }
-                int64_t f_addr = LLVMGetFunctionAddress(jit->engine, fn->name);
-                int64_t (*f)(int64_t*) = (int64_t (*)(int64_t*))f_addr;
-                int64_t ret = (f)(params);
-                LspValue new_val = lsp_new_number(ret);
-                lsp_replace_val(&vm->regs[r1], &new_val);
-                free(params);
-                printf("Compiled func returned: %ld in %d\n", ret, r1);
-                vm->pc++;
-                return 0;
+        if (cache->len < LSP_CALL_CACHE_SIZE) {
+                cache->callees[cache->len++] = v;
         }
+        return fn_index;
+}
 
-        lsp_jit_trace_start(jit);
-        // make sure we can accommodate the new registers
-        size_t top = create_stack_frame(
-                vm,
-                vm->regs_start + vm->state->funcs[vm->curr_fn].regs_in_use,
-                fn->regs_in_use);
+/**
+ * Calls the function described by `d`, from the current frame.
+ *
+ * Compiled functions run straight away. Otherwise, a new frame is pushed and
+ * made current, and the interpreter continues with the first instruction of the
+ * callee.
+ */
+static void push_frame(LspJit jit[static 1], const LspDecoded d[static 1]) {
+        LspVm *vm = &jit->vm;
+        LspValue *fp = &vm->regs[vm->regs_start];
 
-        // save the old state
-        size_t old_pc = vm->pc;
-        size_t old_fn = vm->curr_fn;
-        size_t old_regs_start = vm->regs_start;
+        uint8_t r1 = d->a;
+        uint8_t r2 = d->b;
+        uint8_t r3 = d->c;
+        LspValue v2 = fp[r2];
+        // the callee a call site saw first is checked with a single compare
+        size_t fn_index = v2 == d->cache->callees[0] ? lsp_get_fn(v2) : resolve_callee(jit, d, v2);
 
-        vm->pc = 0;
-        vm->curr_fn = fn_index;
-        vm->regs_start = top;
+        LspNativeFn native = native_entry(jit, fn_index);
+        if (!native) {
+                count_call(jit, fn_index);
+                native = native_entry(jit, fn_index);
+        }
+        // calls with integers too big for native code are interpreted
+        for (uint8_t r = r2 + 1; native && r <= r3; ++r) {
+                if (!fits_native(fp[r])) {
+                        native = NULL;
+                }
+        }
+        if (native) {
+                LspNativeValue params[UINT8_MAX];
+                for (uint8_t r = r2 + 1; r <= r3; ++r) {
+                        params[r - r2 - 1] = to_native(jit, fp[r]);
+                }
+                fp[r1] = from_native(jit, native(params));
+                record_result(jit, fp[r1]);
+                vm->pc++;
+                return;
+        }
 
-        // copy all parameters to the new stack frame
+        open_trace(jit, fn_index);
+        size_t top = enter_frame(jit, fn_index, vm->pc + 1, r1, false);
+        // copy all parameters to the new stack frame, boxes are immutable so
+        // they can be shared
         for (size_t i = r2 + 1, j = top; i <= r3; ++i, ++j) {
-                LspValue v = lsp_copy_val(&vm->regs[i]);
-                lsp_replace_val(&vm->regs[j], &v);
+                vm->regs[j] = fp[i];
         }
-        int ret = lsp_interpret(jit);
+        record_params(jit, top);
+}
+
+/** Pops the current frame, and hands `ret_val` to the caller. */
+static void pop_frame(LspJit jit[static 1], LspValue ret_val) {
+        LspVm *vm = &jit->vm;
+        LspFrame frame = vm->frames[cvector_size(vm->frames) - 1];
+        cvector_pop_back(vm->frames);
+        size_t fn_index = vm->curr_fn;
 
-        // save ret value
-        size_t last_instr = cvector_size(fn->instrs) - 1;
-        LspInstr ret_instr = fn->instrs[last_instr];
-        if (lsp_get_opcode(ret_instr) != OP_RET) {
-                printf("Bytecode of function didn't end in 'ret'.\n");
-                return -1;
+        // everything the callee allocated dies with its frame, except for the
+        // return value, which gets moved into the caller's region
+        for (size_t i = frame.regs_start; i < vm->regs_top; ++i) {
+                vm->regs[i] = 0;
+        }
+        if (lsp_is_boxed(ret_val) && !frame.native_caller) {
+                // releasing the region can free the box
+                LspBox *box = lsp_dup_box(lsp_get_box(ret_val));
+                lsp_arena_release(&vm->arena, frame.mark);
+                ret_val = lsp_copy_box(&vm->arena, box);
+                free(box);
+        } else {
+                lsp_arena_release(&vm->arena, frame.mark);
         }
-        uint8_t r_ret = lsp_get_arg1(ret_instr) + vm->regs_start;
-        lsp_exchange_val(&vm->regs[r1], &vm->regs[r_ret]);
 
-        // restore old state
-        vm->pc = ++old_pc;
-        vm->curr_fn = old_fn;
-        vm->regs_start = old_regs_start;
+        // restore the caller, and continue after its call
+        vm->pc = frame.caller_pc;
+        vm->curr_fn = frame.caller_fn;
+        vm->regs_start = frame.caller_regs_start;
+        vm->regs_top = frame.caller_regs_top;
+        if (!frame.native_caller) {
+                vm->regs[vm->regs_start + frame.ret_reg] = ret_val;
+        }
 
         lsp_jit_trace_end(jit, fn_index);
-        return ret;
+        if (!frame.native_caller) {
+                record_result(jit, ret_val);
+        }
 }
 
-int lsp_interpret(LspJit self[static 1]) {
+/** The code the current frame runs. Frames only start or stop recording at
+backward jumps, where their trace ends. */
+static const LspDecoded* frame_code(LspJit jit[static 1]) {
+        size_t traces = cvector_size(jit->open_traces);
+        return traces > 0 && jit->open_traces[traces - 1].head
+                ? jit->vm.recording_code[jit->vm.curr_fn]
+                : jit->vm.code[jit->vm.curr_fn];
+}
+
+#if defined(__GNUC__) && !defined(LSP_SWITCH_DISPATCH)
+#define LSP_THREADED_DISPATCH
+#endif
+
+#ifdef LSP_THREADED_DISPATCH
+// labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define CASE(op) op_##op
+#define DISPATCH() do {                                         \
+                executed++;                                     \
+                goto *d->handler;                               \
+        } while (0)
+#define EXEC(o) goto *labels[o]
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#define EXEC(o) do {                                            \
+                op = o;                                         \
+                goto dispatch;                                  \
+        } while (0)
+#endif
+
+/**
+ * Runs the current function until it returns.
+ *
+ * \param `handlers` If not NULL, this is set to the handler of each opcode
+ * instead, so that they can be stored in the decoded code.
+ * \return The value returned by the function. Its frame is left for the caller
+ * to pop.
+ */
+static LspValue interpret(LspJit *self, const void *const **handlers) {
+#ifdef LSP_THREADED_DISPATCH
+        static const void *const labels[LSP_NUM_DECODED_OPCODES] = {
+                [OP_LDC] = &&CASE(OP_LDC),
+                [OP_ADD] = &&CASE(OP_ADD),
+                [OP_LDF] = &&CASE(OP_LDF),
+                [OP_CALL] = &&CASE(OP_CALL),
+                [OP_MOV] = &&CASE(OP_MOV),
+                [OP_EQ] = &&CASE(OP_EQ),
+                [OP_TEST] = &&CASE(OP_TEST),
+                [OP_JMP] = &&CASE(OP_JMP),
+                [OP_SUB] = &&CASE(OP_SUB),
+                [OP_RET] = &&CASE(OP_RET),
+                [OP_LDC_BOXED] = &&CASE(OP_LDC_BOXED),
+                [OP_EQ_JMP] = &&CASE(OP_EQ_JMP),
+                [OP_LDC_EQ_JMP] = &&CASE(OP_LDC_EQ_JMP),
+                [OP_LDC_ADD] = &&CASE(OP_LDC_ADD),
+                [OP_LDC_SUB] = &&CASE(OP_LDC_SUB),
+                [OP_RECORD] = &&CASE(OP_RECORD),
+        };
+        if (handlers) {
+                *handlers = labels;
+                return 0;
+        }
+#else
+        if (handlers) {
+                *handlers = NULL;
+                return 0;
+        }
+#endif
         LspVm *vm = &self->vm;
         LspState *state = vm->state;
-        LspFunc *fn = &vm->state->funcs[vm->curr_fn];
-        size_t len = cvector_size(fn->instrs);
-        while (vm->pc < len) {
-                LspInstr i = fn->instrs[vm->pc];
-                lsp_jit_record(self, i);
-                switch (lsp_get_opcode(i)) {
-                case OP_LDC: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        LspValue num = lsp_new_number(
-                                state->ints[lsp_get_long_arg(i)]);
-                        lsp_replace_val(&vm->regs[r1], &num);
-                        vm->pc++;
-                }
-                        break;
-                case OP_ADD: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        uint8_t r2 = lsp_get_arg2(i) + vm->regs_start;
-                        uint8_t r3 = lsp_get_arg3(i) + vm->regs_start;
-                        LspValue add_v = add(vm->regs[r2], vm->regs[r3]);
-                        lsp_replace_val(&vm->regs[r1], &add_v);
-                        vm->pc++;
-                }
-                        break;
-                case OP_SUB: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        uint8_t r2 = lsp_get_arg2(i) + vm->regs_start;
-                        uint8_t r3 = lsp_get_arg3(i) + vm->regs_start;
-                        LspValue sub_v = sub(vm->regs[r2], vm->regs[r3]);
-                        lsp_replace_val(&vm->regs[r1], &sub_v);
-                        vm->pc++;
-                }
-                        break;
-                case OP_EQ: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        uint8_t r2 = lsp_get_arg2(i) + vm->regs_start;
-                        uint8_t r3 = lsp_get_arg3(i) + vm->regs_start;
-                        LspValue eq_v = eq(vm->regs[r2], vm->regs[r3]);
-                        lsp_replace_val(&vm->regs[r1], &eq_v);
-                        vm->pc++;
-                }
-                        break;
-                case OP_LDF: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        LspValue fun = lsp_new_fn(lsp_get_arg2(i));
-                        lsp_replace_val(&vm->regs[r1], &fun);
-                        vm->pc++;
+        // calls and returns switch frames without leaving the loop, which
+        // only ends when the frame it started in returns
+        size_t base = cvector_size(vm->frames);
+        const LspDecoded *code = frame_code(self);
+        const LspDecoded *d = &code[vm->pc];
+        LspValue *fp = &vm->regs[vm->regs_start];
+        LspValue ret_val = 0;
+        uint64_t executed = 0;
+#ifdef LSP_THREADED_DISPATCH
+        DISPATCH();
+#else
+        // every function ends in a `ret`, so there is no need to check the pc
+        for (;;) {
+                executed++;
+                uint8_t op = d->op;
+        dispatch:
+                switch (op) {
+#endif
+                CASE(OP_LDC):
+                        fp[d->a] = d->k;
+                        d++;
+                        DISPATCH();
+                CASE(OP_LDC_BOXED):
+                        fp[d->a] = lsp_new_number(&vm->arena, state->ints[d->index]);
+                        d++;
+                        DISPATCH();
+                CASE(OP_ADD):
+                        fp[d->a] = add(&vm->arena, fp[d->b], fp[d->c]);
+                        d++;
+                        DISPATCH();
+                CASE(OP_SUB):
+                        fp[d->a] = sub(&vm->arena, fp[d->b], fp[d->c]);
+                        d++;
+                        DISPATCH();
+                CASE(OP_EQ):
+                        fp[d->a] = eq(fp[d->b], fp[d->c]);
+                        d++;
+                        DISPATCH();
+                CASE(OP_LDF):
+                        fp[d->a] = d->k;
+                        d++;
+                        DISPATCH();
+                CASE(OP_MOV):
+                        fp[d->a] = fp[d->b];
+                        d++;
+                        DISPATCH();
+                CASE(OP_CALL):
+                        vm->pc = d - code;
+                        push_frame(self, d);
+                        code = frame_code(self);
+                        d = &code[vm->pc];
+                        fp = &vm->regs[vm->regs_start];
+                        DISPATCH();
+                CASE(OP_TEST):
+                        d = lsp_val_to_bool(fp[d->a]) ? &code[d->target] : d + 1;
+                        DISPATCH();
+                CASE(OP_JMP):
+                        if (&code[d->target] <= d) {
+                                vm->pc = d - code;
+                                if (back_edge(self, &ret_val)) {
+                                        goto leave_frame;
+                                }
+                                // the frame may have stopped recording, or
+                                // started to
+                                code = frame_code(self);
+                                d = &code[code[vm->pc].target];
+                                DISPATCH();
+                        }
+                        d = &code[d->target];
+                        DISPATCH();
+                // superinstructions only appear in code that isn't recorded
+                CASE(OP_EQ_JMP): {
+                        LspValue v = eq(fp[d->b], fp[d->c]);
+                        fp[d->a] = v;
+                        d = v == lsp_new_small(true) ? d + 3 : &code[d->target];
                 }
-                        break;
-                case OP_MOV: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        uint8_t r2 = lsp_get_arg2(i) + vm->regs_start;
-                        lsp_replace_val(&vm->regs[r1], &vm->regs[r2]);
-                        vm->pc++;
+                        DISPATCH();
+                CASE(OP_LDC_EQ_JMP): {
+                        fp[d->c] = d->k;
+                        LspValue v = eq(fp[d->b], d->k);
+                        fp[d->a] = v;
+                        d = v == lsp_new_small(true) ? d + 4 : &code[d->target];
                 }
-                        break;
-                case OP_CALL:
-                        interpret_call(self, i);
-                        break;
-                case OP_TEST: {
-                        uint8_t r1 = lsp_get_arg1(i) + vm->regs_start;
-                        LspValue v1 = vm->regs[r1];
-                        if (lsp_val_to_bool(v1)) {
-                                vm->pc++;
+                        DISPATCH();
+                CASE(OP_LDC_ADD):
+                        fp[d->c] = d->k;
+                        fp[d->a] = add(&vm->arena, fp[d->b], d->k);
+                        d += 2;
+                        DISPATCH();
+                CASE(OP_LDC_SUB):
+                        fp[d->c] = d->k;
+                        fp[d->a] = sub(&vm->arena, fp[d->b], d->k);
+                        d += 2;
+                        DISPATCH();
+                CASE(OP_RECORD):
+                        lsp_jit_record(self, d->instr, d - code);
+                        EXEC(d->exec_op);
+                CASE(OP_RET):
+                        ret_val = fp[d->a];
+                leave_frame:
+                        if (cvector_size(vm->frames) == base) {
+                                vm->pc = d - code + 1;
+                                vm->executed += executed;
+                                return ret_val;
                         }
-                        vm->pc++;
-                }
-                        break;
-                case OP_JMP:
-                        vm->pc += lsp_get_long_arg(i);
-                        break;
-                case OP_RET:
-                        // most of this is handled by call
-                        vm->pc++;
-                        break;
-                default:
-                        printf("Not implemented yet...\n");
-                        exit(1);
+                        pop_frame(self, ret_val);
+                        code = frame_code(self);
+                        d = &code[vm->pc];
+                        fp = &vm->regs[vm->regs_start];
+                        DISPATCH();
+#ifndef LSP_THREADED_DISPATCH
                 }
         }
+#endif
+}
+
+#ifdef LSP_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+int lsp_interpret(LspJit self[static 1]) {
+        char here;
+        self->stack_limit = (uintptr_t)&here - LSP_NATIVE_STACK;
+        interpret(self, NULL);
         return 0;
 }
+
+/** Interprets the frame pushed for compiled code, and pops it. */
+static LspNativeValue finish_frame(LspJit jit[static 1]) {
+        LspValue ret_val = interpret(jit, NULL);
+        LspNativeValue ret = to_native(jit, ret_val);
+        pop_frame(jit, ret_val);
+        return ret;
+}
+
+LspNativeValue lsp_jit_call(LspJit *jit,
+                            int64_t fn_index,
+                            int64_t fn_tag,
+                            LspNativeValue *args,
+                            int64_t nargs) {
+        LspVm *vm = &jit->vm;
+        if (fn_tag != TAG_FN) {
+                printf("Not a function.\n");
+                exit(1);
+        }
+        if (fn_index < 0 || (size_t)fn_index >= cvector_size(vm->state->funcs)) {
+                printf("Function index oob.\n");
+                exit(1);
+        }
+        LspNativeFn native = native_entry(jit, fn_index);
+        if (!native) {
+                count_call(jit, fn_index);
+                native = native_entry(jit, fn_index);
+        }
+        if (native) {
+                return native(args);
+        }
+        // the interpreter frame that entered native code is still current, and
+        // already points at its call
+        open_trace(jit, fn_index);
+        size_t top = enter_frame(jit, fn_index, vm->pc, 0, true);
+        for (int64_t i = 0; i < nargs; ++i) {
+                vm->regs[top + i] = from_native(jit, args[i]);
+        }
+        record_params(jit, top);
+        return finish_frame(jit);
+}
+
+/** Interprets the frame of `exit` until it returns, from the registers in
+`values`. */
+static LspNativeValue resume_frame(LspJit jit[static 1],
+                                   const LspSideExit exit[static 1],
+                                   const LspNativeValue values[static UINT8_MAX + 1]) {
+        LspVm *vm = &jit->vm;
+        // the frame starts in the middle of the function, so what it runs
+        // can't be merged with the other traces of the function
+        skip_trace(jit);
+        size_t top = enter_frame(jit, exit->fn, vm->pc, 0, true);
+        for (size_t r = 0; r <= UINT8_MAX; ++r) {
+                if (!exit->live[r]) {
+                        continue;
+                }
+                vm->regs[top + r] = from_native(jit, values[r]);
+        }
+        vm->pc = exit->pc;
+        return finish_frame(jit);
+}
+
+/**
+ * Counts a side exit taken by the optimized code of the function at `f`. Once
+ * there are too many, the paths the code is missing are recorded, and the
+ * function is optimized again.
+ */
+static void count_exit(LspJit self[static 1], size_t f) {
+        LspTiering *tiering = &self->tiering;
+        LspNativeFn entry = atomic_load_explicit(&self->entries[f], memory_order_acquire);
+        void *baseline = lsp_baseline_entry(&self->baseline, f);
+        // baseline code runs until LLVM is done, and only leaves for integers
+        // too big for it
+        if (tiering->tiers[f] != LSP_FN_OPTIMIZED || !entry || (void*)(uintptr_t)entry == baseline) {
+                return;
+        }
+        if (lsp_tiering_count_exit(tiering, f)) {
+                // the code stays around for the frames that are still
+                // running it, but new calls are interpreted
+                atomic_store_explicit(&self->entries[f], NULL, memory_order_release);
+                lsp_tiering_promote(tiering, f, LSP_FN_PROFILING);
+        }
+}
+
+LspNativeValue lsp_jit_deopt(LspJit *jit, const LspSideExit *exit, LspNativeValue *values) {
+        // the exits of inlined functions are taken by the code of their
+        // outermost caller
+        const LspSideExit *outer = exit;
+        while (outer->caller) {
+                outer = outer->caller;
+        }
+        count_exit(jit, outer->fn);
+        LspNativeValue ret = resume_frame(jit, exit, values);
+        // the callers of inlined functions continue after their call, with
+        // what it returned
+        for (const LspSideExit *caller = exit->caller; caller; caller = caller->caller) {
+                values += UINT8_MAX + 1;
+                LspInstr call = jit->vm.state->funcs[caller->fn].instrs[caller->pc - 1];
+                values[lsp_get_arg1(call)] = ret;
+                ret = resume_frame(jit, caller, values);
+        }
+        return ret;
+}
@@ -1,47 +1,252 @@
 #pragma once
 
+#include "arena.h"
+#include "baseline.h"
+#include "cache.h"
 #include "compiler/gen.h"
+#include "decode.h"
+#include "gc.h"
+#include "tiering.h"
 #include "traces.h"
 #include "value.h"
 
 #include <cvector.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <llvm-c/Core.h>
 #include <llvm-c/ExecutionEngine.h>
 #include <llvm-c/Target.h>
 #include <llvm-c/Analysis.h>
 #include <llvm-c/BitWriter.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+
+/** A frame pushed by a call, along with the state of its caller. */
+typedef struct LspFrame {
+        /* Where the registers of the frame start. */
+        size_t regs_start;
+        /* The start of the arena region of the frame. */
+        LspArenaMark mark;
+        /* The state to restore when the frame is popped. */
+        size_t caller_fn;
+        /* The pc the caller continues from. */
+        uint64_t caller_pc;
+        size_t caller_regs_start;
+        size_t caller_regs_top;
+        /* The register of the caller the return value goes into. */
+        uint8_t ret_reg;
+        /* Whether the caller is compiled code, which gets the return value
+        from the interpreter instead of a register. */
+        bool native_caller;
+} LspFrame;
+
+/** How much of the native stack compiled code may use. */
+#define LSP_NATIVE_STACK (4 << 20)
+
+/** How many calls deep compiled code inlines its callees, and how many
+instructions an inlined function has at most. */
+#define LSP_INLINE_DEPTH 2
+#define LSP_INLINE_SIZE 24
+
+/** The number of registers reserved for the stack. */
+#define LSP_MAX_REGS (1 << 22)
 
 typedef struct LspVm {
         size_t regs_start;
-        cvector_vector_type(LspValue) regs;
+        /* The register stack: every frame is a window into it. Registers
+        above `regs_top` are always cleared. */
+        LspValue *regs;
+        size_t regs_top;
+        size_t regs_capacity;
         uint64_t pc;
         LspState *state;
         size_t curr_fn;
+        /* Storage for boxed values, released frame by frame. */
+        LspArena arena;
+        /* All frames, except for the one of the main function. */
+        cvector_vector_type(LspFrame) frames;
+        LspGc gc;
+        /* The number of instructions dispatched so far. */
+        uint64_t executed;
+        /* The decoded instructions of each function. */
+        cvector_vector_type(cvector_vector_type(LspDecoded)) code;
+        /* The same instructions, which also feed the trace recorder. */
+        cvector_vector_type(cvector_vector_type(LspDecoded)) recording_code;
 } LspVm;
 
 LspVm lsp_new_vm(LspState state[static 1]);
 
 void lsp_cleanup_vm(LspVm vm[static 1]);
 
+/** The compilers hot functions can go to. */
+typedef enum LspJitTier {
+        /* Optimizes the trace tree of the function with LLVM. */
+        LSP_TIER_LLVM,
+        /* Translates the bytecode of the function straight to machine code. */
+        LSP_TIER_BASELINE,
+} LspJitTier;
+
+/** Settings of the JIT, usually coming from the command line. */
+typedef struct LspJitOpts {
+        /* Whether to record traces and compile hot functions. */
+        bool enabled;
+        /* The highest tier functions can reach. */
+        LspJitTier tier;
+        LspTierOpts tiering;
+        /* How hard LLVM optimizes compiled code, from 0 (not at all) to 3. */
+        unsigned opt_level;
+        /* Whether to print the IR of every compiled function. */
+        bool dump_ir;
+        /* Whether functions are compiled by a background thread, instead of
+        the interpreter. */
+        bool background;
+        /* Where compiled functions are kept across runs, or NULL. */
+        const char *cache_dir;
+        /* How many bytes the cache may take up. */
+        size_t cache_limit;
+} LspJitOpts;
+
+LspJitOpts lsp_jit_default_opts();
+
+/**
+ * A guard of compiled code, and the state the interpreter needs to take over
+ * when it fails. Side exits are constants of the compiled code, which lays
+ * them out as { i64, i64, [256 x i8], i8* }.
+ */
+typedef struct LspSideExit {
+        /* The function, and the instruction the interpreter resumes at. */
+        uint64_t fn;
+        uint64_t pc;
+        /* Which registers hold a value at the guard. */
+        uint8_t live[UINT8_MAX + 1];
+        /* When the guard is in a function inlined into compiled code, the
+        exit of its caller, which continues after the call once the function
+        returns. */
+        const struct LspSideExit *caller;
+} LspSideExit;
+
+/**
+ * A value passed to or returned by native code: an unboxed integer, or the
+ * index of a function, along with its LspTag. Compiled code lays it out as
+ * { i64, i64 }, and returns it in two registers.
+ */
+typedef struct LspNativeValue {
+        int64_t v;
+        int64_t tag;
+} LspNativeValue;
+
+/**
+ * The tag of a native value that stands for an integer too big for native
+ * code, which is kept by the JIT in the meantime. These are only ever returned
+ * to compiled code by the interpreter, and compiled code exits to the
+ * interpreter as soon as it gets one.
+ */
+#define LSP_NATIVE_BIG 2
+
+/** The native code of a compiled function:
+LspNativeValue f(LspNativeValue *params). */
+typedef LspNativeValue (*LspNativeFn)(LspNativeValue *params);
+
+/** A function waiting to be compiled by the background thread. */
+typedef struct LspCompileJob {
+        size_t f;
+        /* Copies of the trace tree and of the parameter types of the
+        function, owned by the job. */
+        TraceNode *tree;
+        uint8_t *param_tags;
+        /* Copies of the trees of the functions that can be inlined, by
+        function, also owned by the job. */
+        TraceNode **inline_trees;
+} LspCompileJob;
+
 typedef struct LspJit {
         TraceMap traces;
         cvector_vector_type(TraceList) open_traces;
         LspVm vm;
-        LLVMModuleRef module;
         LLVMExecutionEngineRef engine;
-        cvector_vector_type(LLVMValueRef) compiled_funcs;
+        /* The optimizations run on every compiled function. */
+        LLVMPassManagerRef passes;
+        /* The tier of each function, and how hot it is. */
+        LspTiering tiering;
+        /* The types each function was called with, merged with
+        `lsp_merge_tag`. */
+        cvector_vector_type(uint8_t*) param_tags;
+        /* The entry point of each compiled function, or NULL. Entries are
+        published by the compiler thread. */
+        cvector_vector_type(_Atomic(LspNativeFn)) entries;
+        LspCodeCache cache;
+        LspBaseline baseline;
+        /* Native code only calls further while the stack is above this
+        address, deeper calls are interpreted. */
+        uintptr_t stack_limit;
+        /* The integer of the last LSP_NATIVE_BIG handed to native code, or
+        NULL. */
+        LspBox *native_big;
+        LspJitOpts opts;
+        /* The number of compiled functions, and the time it took. */
+        size_t compiled;
+        double compile_time;
+        /* How many frames left the code they were running for newer code, at
+        the start of a loop. */
+        size_t osr_entries;
+        /* The background compiler, which is started by the first job. The
+        lock guards the queue and the statistics. */
+        bool compiler_started;
+        bool compiler_stopping;
+        pthread_t compiler;
+        pthread_mutex_t lock;
+        pthread_cond_t jobs_ready;
+        cvector_vector_type(LspCompileJob) jobs;
 } LspJit;
 
-LspJit lsp_jit_new(LspState state[static 1]);
+LspJit lsp_jit_new(LspState state[static 1], LspJitOpts opts);
 
 void lsp_jit_free(LspJit self[static 1]);
 
+/** Makes the functions found in the code cache native, before the program
+starts. */
+void lsp_jit_load_cache(LspJit self[static 1]);
+
+/** Stops the compiler thread, dropping the jobs it didn't get to. Functions
+that are still queued stay in the tier they are in. */
+void lsp_jit_stop_compiler(LspJit self[static 1]);
+
+/** Prints the stats of the JIT, once the compiler thread is stopped. */
+void lsp_jit_print_stats(LspJit self[static 1]);
+
 void lsp_jit_trace_start(LspJit self[static 1]);
 
-void lsp_jit_record(LspJit self[static 1], LspInstr i);
+void lsp_jit_record(LspJit self[static 1], LspInstr i, size_t pc);
 
 void lsp_jit_trace_end(LspJit self[static 1], size_t func);
 
 int lsp_interpret(LspJit self[static 1]);
 
-int lsp_dispatch();
+/**
+ * Calls the function at `fn_index` from compiled code, with `nargs` arguments.
+ * `fn_tag` is the type of the callee, which has to be a function.
+ *
+ * The callee runs natively if it is compiled, otherwise it is interpreted until
+ * it returns.
+ */
+LspNativeValue lsp_jit_call(LspJit *jit,
+                            int64_t fn_index,
+                            int64_t fn_tag,
+                            LspNativeValue *args,
+                            int64_t nargs);
+
+/**
+ * Called by baseline code once the function at `f` is hot enough to be
+ * optimized. Functions without stable traces go back to the interpreter to
+ * record some first.
+ */
+void lsp_jit_tier_up(LspJit *jit, int64_t f);
+
+/**
+ * Called by compiled code when the guard of `exit` fails. `values` holds the
+ * registers of the function at that point, and the rest of the call is
+ * interpreted. Functions inlined into the compiled code are finished first,
+ * and then their callers, whose registers follow in `values`, 256 per frame.
+ *
+ * \return The value returned by the function.
+ */
+LspNativeValue lsp_jit_deopt(LspJit *jit, const LspSideExit *exit, LspNativeValue *values);
@@ -0,0 +1,153 @@
+#include "tiering.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Reads the threshold `name` from the environment, if it is set. */
+static void read_env(const char *name, uint32_t value[static 1]) {
+        const char *s = getenv(name);
+        if (!s) {
+                return;
+        }
+        char *end = NULL;
+        unsigned long n = strtoul(s, &end, 10);
+        if (*s == '\0' || *end != '\0' || n > UINT32_MAX) {
+                printf("Invalid value for %s: %s.\n", name, s);
+                exit(1);
+        }
+        *value = n;
+}
+
+LspTierOpts lsp_tier_default_opts() {
+        LspTierOpts opts = {
+                .baseline_at = 2,
+                .optimize_at = 16,
+                .stable_traces = 4,
+                .min_work = 64,
+                .recompile_after = 256,
+        };
+        read_env("LSP_JIT_BASELINE_AT", &opts.baseline_at);
+        read_env("LSP_JIT_OPTIMIZE_AT", &opts.optimize_at);
+        read_env("LSP_JIT_STABLE_TRACES", &opts.stable_traces);
+        read_env("LSP_JIT_MIN_WORK", &opts.min_work);
+        read_env("LSP_JIT_RECOMPILE_AFTER", &opts.recompile_after);
+        return opts;
+}
+
+LspTiering lsp_tiering_new(const LspState state[static 1], LspTierOpts opts) {
+        LspTiering tiering = {
+                .opts = opts,
+                .tiers = NULL,
+                .hotness = NULL,
+                .stable = NULL,
+                .sizes = NULL,
+                .exits = NULL,
+                .recompiles = NULL,
+                .wait_until = NULL,
+                .to_baseline = 0,
+                .to_profiling = 0,
+                .to_optimized = 0,
+                .recompiled = 0,
+        };
+        for (size_t i = 0; i < cvector_size(state->funcs); ++i) {
+                cvector_push_back(tiering.tiers, LSP_FN_INTERPRETED);
+                cvector_push_back(tiering.hotness, 0);
+                cvector_push_back(tiering.stable, 0);
+                cvector_push_back(tiering.sizes, cvector_size(state->funcs[i].instrs));
+                cvector_push_back(tiering.exits, 0);
+                cvector_push_back(tiering.recompiles, 0);
+                cvector_push_back(tiering.wait_until, 0);
+        }
+        return tiering;
+}
+
+/**
+ * The hotness at which the function at `f` moves to a tier that starts at
+ * hotness `at`, once the work the function does is taken into account.
+ */
+static uint64_t threshold(const LspTiering self[static 1], size_t f, uint32_t at) {
+        uint64_t size = self->sizes[f] > 0 ? self->sizes[f] : 1;
+        uint64_t work = (self->opts.min_work + size - 1) / size;
+        return work > at ? work : at;
+}
+
+uint64_t lsp_tiering_optimize_at(const LspTiering self[static 1], size_t f) {
+        return threshold(self, f, self->opts.optimize_at);
+}
+
+bool lsp_tiering_wants_baseline(const LspTiering self[static 1], size_t f) {
+        return self->opts.baseline_at > 0
+                && self->tiers[f] == LSP_FN_INTERPRETED
+                && self->hotness[f] >= threshold(self, f, self->opts.baseline_at);
+}
+
+bool lsp_tiering_is_stable(const LspTiering self[static 1], size_t f) {
+        return self->stable[f] > 0 && self->stable[f] >= self->opts.stable_traces;
+}
+
+bool lsp_tiering_wants_optimized(const LspTiering self[static 1], size_t f) {
+        LspFnTier tier = self->tiers[f];
+        return (tier == LSP_FN_INTERPRETED || tier == LSP_FN_PROFILING)
+                && lsp_tiering_is_stable(self, f)
+                && self->hotness[f] >= lsp_tiering_optimize_at(self, f)
+                && self->hotness[f] >= self->wait_until[f];
+}
+
+bool lsp_tiering_records(const LspTiering self[static 1], size_t f) {
+        LspFnTier tier = self->tiers[f];
+        return tier == LSP_FN_INTERPRETED || tier == LSP_FN_PROFILING;
+}
+
+bool lsp_tiering_count_exit(LspTiering self[static 1], size_t f) {
+        uint64_t limit = (uint64_t)self->opts.recompile_after << self->recompiles[f];
+        // exits the new code takes anyway don't get it recompiled forever
+        if (self->opts.recompile_after == 0 || self->recompiles[f] >= 32 || ++self->exits[f] < limit) {
+                return false;
+        }
+        self->exits[f] = 0;
+        self->recompiles[f]++;
+        self->recompiled++;
+        self->wait_until[f] = self->hotness[f] + self->opts.recompile_after;
+        return true;
+}
+
+void lsp_tiering_returned(LspTiering self[static 1], size_t f) {
+        self->wait_until[f] = 0;
+}
+
+void lsp_tiering_promote(LspTiering self[static 1], size_t f, LspFnTier tier) {
+        self->tiers[f] = tier;
+        switch (tier) {
+        case LSP_FN_INTERPRETED:
+                break;
+        case LSP_FN_BASELINE:
+                self->to_baseline++;
+                break;
+        case LSP_FN_PROFILING:
+                self->to_profiling++;
+                break;
+        case LSP_FN_OPTIMIZED:
+                self->exits[f] = 0;
+                self->to_optimized++;
+                break;
+        }
+}
+
+void lsp_tiering_print_stats(const LspTiering self[static 1]) {
+        printf("Tiering: %ld functions to baseline, %ld back to profiling, %ld optimized, "
+               "%ld optimized again after side exits.\n",
+               self->to_baseline,
+               self->to_profiling,
+               self->to_optimized,
+               self->recompiled);
+}
+
+void lsp_tiering_free(LspTiering self[static 1]) {
+        cvector_free(self->tiers);
+        cvector_free(self->hotness);
+        cvector_free(self->stable);
+        cvector_free(self->sizes);
+        cvector_free(self->exits);
+        cvector_free(self->recompiles);
+        cvector_free(self->wait_until);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "compiler/gen.h"
+
+#include <cvector.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Where a function runs. */
+typedef enum LspFnTier {
+        /* In the interpreter, which records its traces. */
+        LSP_FN_INTERPRETED,
+        /* As code from the baseline compiler. */
+        LSP_FN_BASELINE,
+        /* Back in the interpreter after running as baseline code, until it
+        has traces stable enough to be optimized. */
+        LSP_FN_PROFILING,
+        /* Handed to LLVM. */
+        LSP_FN_OPTIMIZED,
+} LspFnTier;
+
+/** When functions move up a tier. */
+typedef struct LspTierOpts {
+        /* The hotness at which a function is compiled by the baseline
+        compiler, or 0 to skip that tier. */
+        uint32_t baseline_at;
+        /* The hotness at which a function is optimized. */
+        uint32_t optimize_at;
+        /* How many times a path through a function has to be recorded before
+        its traces are optimized. */
+        uint32_t stable_traces;
+        /* The least work, as hotness times the number of instructions, a
+        function has to do before it is compiled at all. */
+        uint32_t min_work;
+        /* How many side exits the optimized code of a function takes before
+        the function is recorded and optimized again, which doubles each time
+        it is, or 0 to never do so. The function is only optimized again once
+        one of its calls returned, or after as much hotness. */
+        uint32_t recompile_after;
+} LspTierOpts;
+
+/** The default thresholds, overridden by LSP_JIT_BASELINE_AT,
+LSP_JIT_OPTIMIZE_AT, LSP_JIT_STABLE_TRACES, LSP_JIT_MIN_WORK and
+LSP_JIT_RECOMPILE_AFTER. */
+LspTierOpts lsp_tier_default_opts();
+
+/**
+ * Decides which tier each function runs in.
+ *
+ * The hotness of a function counts its calls and the back-edges it takes. A
+ * function is compiled once it is hot enough, and did enough work for
+ * compiling it to pay off: tiny functions need more calls than big ones, and
+ * functions that are rarely called stay in the interpreter.
+ */
+typedef struct LspTiering {
+        LspTierOpts opts;
+        cvector_vector_type(LspFnTier) tiers;
+        /* Baseline code bumps these itself, so they are 64 bits wide. */
+        cvector_vector_type(uint64_t) hotness;
+        /* The number of times the most recorded path of each function was
+        recorded. */
+        cvector_vector_type(size_t) stable;
+        /* The number of instructions of each function. */
+        cvector_vector_type(size_t) sizes;
+        /* The side exits taken by the optimized code of each function since
+        it was optimized, and how many times it was optimized again. */
+        cvector_vector_type(size_t) exits;
+        cvector_vector_type(size_t) recompiles;
+        /* The hotness each function has to reach before it is optimized
+        again, unless one of its calls returns first. Loops move to new code
+        before they return, and would never record their exit otherwise. */
+        cvector_vector_type(uint64_t) wait_until;
+        /* How many functions went to the baseline compiler, back to the
+        interpreter, and to LLVM, and how many were optimized again. */
+        size_t to_baseline;
+        size_t to_profiling;
+        size_t to_optimized;
+        size_t recompiled;
+} LspTiering;
+
+LspTiering lsp_tiering_new(const LspState state[static 1], LspTierOpts opts);
+
+/** The hotness at which the function at `f` is optimized. */
+uint64_t lsp_tiering_optimize_at(const LspTiering self[static 1], size_t f);
+
+/** Whether the function at `f` should go to the baseline compiler now. */
+bool lsp_tiering_wants_baseline(const LspTiering self[static 1], size_t f);
+
+/** Whether the function at `f` has traces worth optimizing. */
+bool lsp_tiering_is_stable(const LspTiering self[static 1], size_t f);
+
+/** Whether the function at `f` should be optimized now. */
+bool lsp_tiering_wants_optimized(const LspTiering self[static 1], size_t f);
+
+/** Whether the interpreter should record the traces of the function at `f`. */
+bool lsp_tiering_records(const LspTiering self[static 1], size_t f);
+
+/**
+ * Counts a side exit taken by the optimized code of the function at `f`.
+ *
+ * \return Whether the function left its code often enough to be recorded and
+ * optimized again.
+ */
+bool lsp_tiering_count_exit(LspTiering self[static 1], size_t f);
+
+/** Notes that a call to the function at `f` was recorded until it returned. */
+void lsp_tiering_returned(LspTiering self[static 1], size_t f);
+
+/** Moves the function at `f` to `tier`. */
+void lsp_tiering_promote(LspTiering self[static 1], size_t f, LspFnTier tier);
+
+void lsp_tiering_print_stats(const LspTiering self[static 1]);
+
+void lsp_tiering_free(LspTiering self[static 1]);
@@ -4,14 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define HOT_TRACE_COUNT 4
-
-TraceNode lsp_trace_node_new(LspInstr instr, NodeMetadata md) {
+TraceNode lsp_trace_node_new(LspInstr instr, size_t pc, NodeMetadata md) {
         TraceNode ret = {
                 .instr = instr,
                 .type = NODE_INSTR,
                 .children = {NULL, NULL},
+                .pc = pc,
                 .metadata = md,
+                .tag = LSP_TAG_UNSEEN,
         };
         return ret;
 }
@@ -21,7 +21,9 @@ TraceNode lsp_trace_node_new_len(size_t len) {
                 .trace_len = len,
                 .type = NODE_LEN,
                 .children = {NULL, NULL},
+                .pc = 0,
                 .metadata = NODE_MD_NONE,
+                .tag = LSP_TAG_UNSEEN,
         };
         return ret;
 }
@@ -62,7 +64,9 @@ static TraceNode* clone_trace_node(TraceNode self[static 1]) {
         TraceNode data = {
                 .type = self->type,
                 .children = {NULL, NULL},
+                .pc = self->pc,
                 .metadata = self->metadata,
+                .tag = self->tag,
         };
         *node = data;
         if (self->type == NODE_INSTR) {
@@ -74,6 +78,16 @@ static TraceNode* clone_trace_node(TraceNode self[static 1]) {
 
 }
 
+TraceNode* lsp_trace_node_clone(TraceNode self[static 1]) {
+        TraceNode *node = clone_trace_node(self);
+        for (uint8_t i = 0; i < 2; ++i) {
+                if (self->children[i]) {
+                        node->children[i] = lsp_trace_node_clone(self->children[i]);
+                }
+        }
+        return node;
+}
+
 static void print_trace_node(TraceNode self[static 1], size_t level) {
         printf("|");
         for (size_t i = 0; i < level; ++i) {
@@ -135,27 +149,40 @@ TraceMap lsp_trace_map_new() {
         return map;
 }
 
-TraceNode* lsp_trace_map_get(const TraceMap self[static 1], size_t i) {
-        size_t capacity = self->capacity;
-        size_t map_index = i % capacity;
-        FuncTrace p = self->traces[map_index];
-        size_t seen = 0;
-        while (p.index != 0 && p.index != i && seen < self->len) {
-                map_index = (map_index + 1) % capacity;
-                p = self->traces[map_index];
-                seen++;
+/**
+ * The slot of the function at `i`, or the empty slot it would go in. Slots are
+ * probed linearly, and index 0 marks an empty slot: the main function is never
+ * traced.
+ */
+static FuncTrace* find_slot(const TraceMap self[static 1], size_t i) {
+        size_t map_index = i % self->capacity;
+        while (self->traces[map_index].index != 0 && self->traces[map_index].index != i) {
+                map_index = (map_index + 1) % self->capacity;
         }
-        return p.traces;
+        return &self->traces[map_index];
+}
+
+TraceNode* lsp_trace_map_get(const TraceMap self[static 1], size_t i) {
+        FuncTrace *slot = find_slot(self, i);
+        return slot->index == i ? slot->traces : NULL;
 }
 
 static void resize(TraceMap self[static 1]) {
-        size_t new_len = self->capacity * 2;
-        self->traces = lsp_realloc(self->traces, new_len * sizeof(FuncTrace));
-        for (size_t i = self->capacity; i < new_len; ++i) {
+        FuncTrace *old = self->traces;
+        size_t old_capacity = self->capacity;
+        self->capacity *= 2;
+        self->traces = lsp_malloc(self->capacity * sizeof(FuncTrace));
+        for (size_t i = 0; i < self->capacity; ++i) {
                 self->traces[i].index = 0;
                 self->traces[i].traces = NULL;
         }
-        self->capacity = new_len;
+        // functions move to the slot their index hashes to now
+        for (size_t i = 0; i < old_capacity; ++i) {
+                if (old[i].index != 0) {
+                        *find_slot(self, old[i].index) = old[i];
+                }
+        }
+        free(old);
 }
 
 static bool equals(TraceNode n1[static 1], TraceNode n2[static 1]) {
@@ -178,8 +205,9 @@ static bool equals(TraceNode n1[static 1], TraceNode n2[static 1]) {
  *
  * \param `to` The tree of traces.
  * \param `from` The list of traced instructions.
+ * \return How many times the path of `from` was recorded, including this one.
  */
-static bool merge_traces(TraceNode to[static 1], TraceNode from[static 1]) {
+static size_t merge_traces(TraceNode to[static 1], TraceNode from[static 1]) {
         TraceNode *prev_to = to, *prev_from = from;
 
         // metadata == False means that we took the false branch, which is the
@@ -187,6 +215,7 @@ static bool merge_traces(TraceNode to[static 1], TraceNode from[static 1]) {
         while (from) {
                 // when `to` is NULL, it means our trace went on a new path of execution
                 if (to && equals(to, from)) {
+                        to->tag = lsp_merge_tag(to->tag, from->tag);
                         uint8_t path = 1;
                         if (from->metadata == NODE_MD_NONE || from->metadata == NODE_MD_TRUE) {
                                 path = 0;
@@ -207,36 +236,26 @@ static bool merge_traces(TraceNode to[static 1], TraceNode from[static 1]) {
                 }
         }
         if (to && to->type == NODE_LEN) {
-                if (++to->trace_len == HOT_TRACE_COUNT) {
-                        // TODO:
-                        //   * convert "test" instrs into guards
-                        return true;
-                }
-        } else {
-                TraceNode *node = lsp_malloc(sizeof(TraceNode));
-                *node = lsp_trace_node_new_len(1);
-                lsp_trace_node_add_child(prev_to, node);
+                return ++to->trace_len;
         }
-        return false;
+        TraceNode *node = lsp_malloc(sizeof(TraceNode));
+        *node = lsp_trace_node_new_len(1);
+        lsp_trace_node_add_child(prev_to, node);
+        return 1;
 }
 
-bool lsp_trace_map_insert(TraceMap self[static 1], size_t i, TraceList trace[static 1]) {
+size_t lsp_trace_map_insert(TraceMap self[static 1], size_t i, TraceList trace[static 1]) {
         TraceNode *res = lsp_trace_map_get(self, i);
         if (!res) {
-                if (self->capacity == self->len) {
+                // keep an empty slot around, so that probing ends
+                if (2 * (self->len + 1) > self->capacity) {
                         resize(self);
                 }
-                size_t capacity = self->capacity;
-                size_t map_index = i % capacity;
-                FuncTrace p = self->traces[map_index];
-                while (p.index != 0 || p.index == i) {
-                        map_index = (map_index + 1) % capacity;
-                        p = self->traces[map_index];
-                }
-                self->traces[map_index].index = i;
+                FuncTrace *slot = find_slot(self, i);
+                slot->index = i;
                 TraceNode *node = lsp_malloc(sizeof(TraceNode));
-                *node = lsp_trace_node_new(0, NODE_MD_NONE);
-                self->traces[map_index].traces = node;
+                *node = lsp_trace_node_new(0, 0, NODE_MD_NONE);
+                slot->traces = node;
                 res = node;
                 self->len++;
         }
@@ -18,17 +18,30 @@ typedef enum NodeMetadata {
         NODE_MD_NONE,
 } NodeMetadata;
 
+/* The types the recorder saw for a value: an LspTag, or one of these. */
+#define LSP_TAG_UNSEEN (UINT8_MAX - 1)
+#define LSP_TAG_MIXED UINT8_MAX
+
+/** Adds `tag` to the types `seen` so far. */
+static inline uint8_t lsp_merge_tag(uint8_t seen, uint8_t tag) {
+        return seen == LSP_TAG_UNSEEN || seen == tag ? tag : LSP_TAG_MIXED;
+}
+
 typedef struct TraceNode {
         union {
                 LspInstr instr;
                 size_t trace_len;
         };
         struct TraceNode* children[2];
+        /* Where the instruction is in its function. */
+        size_t pc;
         NodeType type;
         NodeMetadata metadata;
+        /* CALL: the types of the values the call returned. */
+        uint8_t tag;
 } TraceNode;
 
-TraceNode lsp_trace_node_new(LspInstr instr, NodeMetadata md);
+TraceNode lsp_trace_node_new(LspInstr instr, size_t pc, NodeMetadata md);
 
 TraceNode lsp_trace_node_new_len(size_t len);
 
@@ -38,6 +51,9 @@ TraceNode* lsp_trace_node_insert_child(TraceNode self[static 1], TraceNode node[
 
 void lsp_trace_node_free(TraceNode self[static 1]);
 
+/** Copies the tree starting at `self`. */
+TraceNode* lsp_trace_node_clone(TraceNode self[static 1]);
+
 void lsp_trace_node_print(TraceNode node[static 1]);
 
 typedef struct TraceList {
@@ -66,6 +82,8 @@ TraceMap lsp_trace_map_new();
 
 TraceNode* lsp_trace_map_get(const TraceMap self[static 1], size_t i);
 
-bool lsp_trace_map_insert(TraceMap self[static 1], size_t i, TraceList trace[static 1]);
+/** Adds `trace` to the traces of the function at `i`, and returns how many
+times its path has been recorded. */
+size_t lsp_trace_map_insert(TraceMap self[static 1], size_t i, TraceList trace[static 1]);
 
 void lsp_trace_map_free(TraceMap self[static 1]);
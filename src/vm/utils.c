@@ -1,7 +1,13 @@
+#define _DEFAULT_SOURCE
+
 #include "utils.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 inline void* lsp_malloc(size_t s) {
         void *m = malloc(s);
@@ -20,3 +26,53 @@ inline void* lsp_realloc(void *ptr, size_t s) {
         }
         return m;
 }
+
+static size_t guarded_size(size_t s) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        return (s + page - 1) / page * page + page;
+}
+
+void* lsp_reserve(size_t s) {
+        size_t len = guarded_size(s);
+        void *m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED) {
+                printf("OOM!\n");
+                exit(-1);
+        }
+        // any access past the end faults, instead of corrupting the heap
+        size_t page = sysconf(_SC_PAGESIZE);
+        if (mprotect((char*)m + len - page, page, PROT_NONE) != 0) {
+                printf("Failed to protect guard page.\n");
+                exit(-1);
+        }
+        return m;
+}
+
+void lsp_unreserve(void *ptr, size_t s) {
+        munmap(ptr, guarded_size(s));
+}
+
+void* lsp_map_code(const void *code, size_t s) {
+        void *m = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+                printf("OOM!\n");
+                exit(-1);
+        }
+        memcpy(m, code, s);
+        if (mprotect(m, s, PROT_READ | PROT_EXEC) != 0) {
+                printf("Failed to make code executable.\n");
+                exit(-1);
+        }
+        return m;
+}
+
+void lsp_unmap_code(void *ptr, size_t s) {
+        munmap(ptr, s);
+}
+
+double lsp_now() {
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
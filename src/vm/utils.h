@@ -5,3 +5,18 @@
 void* lsp_malloc(size_t s);
 
 void* lsp_realloc(void *ptr, size_t s);
+
+/** Reserves `s` bytes of zeroed memory, followed by a guard page. Pages are
+only committed once they are touched. */
+void* lsp_reserve(size_t s);
+
+void lsp_unreserve(void *ptr, size_t s);
+
+/** Copies `s` bytes of machine code into fresh pages, which can be executed
+but not written to. */
+void* lsp_map_code(const void *code, size_t s);
+
+void lsp_unmap_code(void *ptr, size_t s);
+
+/** The current time, in seconds. */
+double lsp_now();
@@ -1,91 +1,119 @@
 #include "value.h"
+#include "bigint.h"
 #include "utils.h"
 
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 #define LSP_TAG_MASK 0xfffffffffffffff0
+#define LSP_BOX_BITS 0x0
+#define LSP_FN_BITS 0x2
 
-LspValue lsp_new_number(int64_t n) {
-        int64_t *n_ptr = lsp_malloc(sizeof(n));
-        *n_ptr = n;
-        return ((uintptr_t)n_ptr & LSP_TAG_MASK) + TAG_INT;
+static LspValue box_number(LspArena arena[static 1], int64_t n) {
+        LspBox *box = lsp_alloc_box(arena, 1);
+        box->size = n < 0 ? -1 : 1;
+        box->limbs[0] = n < 0 ? -(uint64_t)n : (uint64_t)n;
+        return lsp_new_box(box);
+}
+
+LspValue lsp_new_number(LspArena arena[static 1], int64_t n) {
+        if (n >= LSP_SMALL_MIN && n <= LSP_SMALL_MAX) {
+                return lsp_new_small(n);
+        }
+        // slow path: the number doesn't fit in 63 bits
+        return box_number(arena, n);
+}
+
+LspBox* lsp_alloc_box(LspArena arena[static 1], size_t limbs) {
+        LspBox *box = lsp_arena_alloc(arena, sizeof(LspBox) + limbs * sizeof(uint64_t));
+        box->forward = NULL;
+        box->size = limbs;
+        return box;
+}
+
+size_t lsp_box_bytes(const LspBox *box) {
+        size_t limbs = box->size < 0 ? -box->size : box->size;
+        return sizeof(LspBox) + limbs * sizeof(uint64_t);
+}
+
+LspValue lsp_copy_box(LspArena arena[static 1], const LspBox *box) {
+        size_t bytes = lsp_box_bytes(box);
+        LspBox *copy = lsp_arena_alloc(arena, bytes);
+        memcpy(copy, box, bytes);
+        copy->forward = NULL;
+        return lsp_new_box(copy);
+}
+
+LspBox* lsp_dup_box(const LspBox *box) {
+        size_t bytes = lsp_box_bytes(box);
+        LspBox *copy = lsp_malloc(bytes);
+        memcpy(copy, box, bytes);
+        copy->forward = NULL;
+        return copy;
 }
 
 inline LspValue lsp_new_fn(uint8_t fn) {
         uint16_t fn2 = ((uint16_t) fn) << 4;
-        return ((uintptr_t)fn2 & LSP_TAG_MASK) + TAG_FN;
+        return ((uintptr_t)fn2 & LSP_TAG_MASK) + LSP_FN_BITS;
 }
 
 inline LspTag lsp_get_tag(LspValue v) {
-        return v & 0xf;
+        if (lsp_is_small(v) || (v & 0xf) == LSP_BOX_BITS) {
+                return TAG_INT;
+        }
+        return TAG_FN;
 }
 
-inline int64_t* lsp_get_number(LspValue v) {
-        return (int64_t*)(v | TAG_INT);
+inline bool lsp_is_boxed(LspValue v) {
+        return v != 0 && (v & 0xf) == LSP_BOX_BITS;
 }
 
-inline uint8_t lsp_get_fn(LspValue v) {
-        return (uint8_t)((v | TAG_FN) >> 4);
+inline LspBox* lsp_get_box(LspValue v) {
+        return (LspBox*)(v & LSP_TAG_MASK);
 }
 
-void lsp_print_val(LspValue v) {
-        switch (lsp_get_tag(v)) {
-                case TAG_INT:
-                        printf("Num: %ld\n", *lsp_get_number(v));
-                        break;
-                case TAG_FN:
-                        printf("Fn: %d\n", lsp_get_fn(v));
-                        break;
-        }
+inline LspValue lsp_new_box(LspBox *box) {
+        return ((uintptr_t)box & LSP_TAG_MASK) + LSP_BOX_BITS;
 }
 
-void lsp_free_val(LspValue v) {
-        if (v == 0) {
-                return;
+bool lsp_get_int64(LspValue v, int64_t n[static 1]) {
+        if (lsp_is_small(v)) {
+                *n = lsp_get_small(v);
+                return true;
         }
-        switch (lsp_get_tag(v)) {
-                case TAG_INT:
-                        free(lsp_get_number(v));
-                        break;
-                default:
-                        break;
+        LspBox *box = lsp_get_box(v);
+        if (box->size == 1 && box->limbs[0] <= INT64_MAX) {
+                *n = box->limbs[0];
+                return true;
         }
+        if (box->size == -1 && box->limbs[0] <= (uint64_t)INT64_MAX + 1) {
+                *n = (int64_t)-box->limbs[0];
+                return true;
+        }
+        return false;
 }
 
-void lsp_replace_val(LspValue *self, LspValue *with) {
-        lsp_free_val(*self);
-        *self = *with;
-        *with = 0;
-}
-
-void lsp_exchange_val(LspValue *self, LspValue *with) {
-        LspValue tmp = *self;
-        *self = *with;
-        *with = tmp;
+inline uint8_t lsp_get_fn(LspValue v) {
+        return (uint8_t)(v >> 4);
 }
 
-LspValue lsp_copy_val(LspValue *self) {
-        switch (lsp_get_tag(*self)) {
+void lsp_print_val(LspValue v) {
+        switch (lsp_get_tag(v)) {
                 case TAG_INT:
-                        return lsp_new_number(*lsp_get_number(*self));
-                default:
-                        return *self;
+                        printf("Num: ");
+                        lsp_big_print(v);
+                        printf("\n");
+                        break;
+                case TAG_FN:
+                        printf("Fn: %d\n", lsp_get_fn(v));
+                        break;
         }
 }
 
 bool lsp_val_to_bool(LspValue self) {
-        LspTag t1 = lsp_get_tag(self);
-        switch (t1) {
-                case TAG_INT: {
-                        int64_t *n = lsp_get_number(self);
-                        if (*n != 0) {
-                                return true;
-                        }
-                }
-                        return false;
-                case TAG_FN:
-                        return true;
+        if (lsp_is_small(self)) {
+                return lsp_get_small(self) != 0;
         }
-        return false;
+        // boxed integers are never 0, and functions are always true
+        return true;
 }
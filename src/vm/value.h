@@ -1,5 +1,7 @@
 #pragma once
 
+#include "arena.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -8,26 +10,76 @@ typedef enum LspTag {
         TAG_FN = 1,
 } LspTag;
 
+/**
+ * A tagged VM value.
+ *
+ * Integers that fit in 63 bits are stored in the value itself, with the
+ * lowest bit set. Everything else is either a pointer to a boxed integer
+ * (lowest 4 bits clear), or a function index. `0` is the empty value.
+ *
+ * Boxed integers can be of any size, and live in the arena of the VM. They are
+ * owned by the garbage collector: they are immutable, so registers can share
+ * them freely. Integers are only boxed if they don't fit in 63 bits, so that
+ * every integer has a single representation.
+ */
 typedef uintptr_t LspValue;
 
-LspValue lsp_new_number(int64_t n);
+/** The heap representation of a boxed integer. */
+typedef struct LspBox {
+        /* Where the box was moved to during a collection, or NULL. */
+        struct LspBox *forward;
+        /* The number of limbs, negated for negative integers. */
+        int64_t size;
+        /* The magnitude of the integer, least significant limb first. The
+        most significant limb is never 0. */
+        uint64_t limbs[];
+} LspBox;
+
+#define LSP_SMALL_MAX (INT64_MAX >> 1)
+#define LSP_SMALL_MIN (INT64_MIN >> 1)
+
+static inline bool lsp_is_small(LspValue v) {
+        return v & 1;
+}
+
+static inline LspValue lsp_new_small(int64_t n) {
+        return ((uintptr_t)n << 1) | 1;
+}
+
+static inline int64_t lsp_get_small(LspValue v) {
+        return (int64_t)v >> 1;
+}
+
+LspValue lsp_new_number(LspArena arena[static 1], int64_t n);
+
+/** Allocates a box of `limbs` limbs in `arena`, for the caller to fill in. */
+LspBox* lsp_alloc_box(LspArena arena[static 1], size_t limbs);
+
+/** The number of bytes `box` takes up. */
+size_t lsp_box_bytes(const LspBox *box);
+
+/** A copy of `box` in `arena`. */
+LspValue lsp_copy_box(LspArena arena[static 1], const LspBox *box);
+
+/** A copy of `box` on the heap, which the caller frees. */
+LspBox* lsp_dup_box(const LspBox *box);
 
 LspValue lsp_new_fn(uint8_t fn);
 
 LspTag lsp_get_tag(LspValue v);
 
-int64_t* lsp_get_number(LspValue v);
+/** Whether `v` points to a value stored in the arena. */
+bool lsp_is_boxed(LspValue v);
 
-uint8_t lsp_get_fn(LspValue v);
+LspBox* lsp_get_box(LspValue v);
 
-void lsp_print_val(LspValue v);
+LspValue lsp_new_box(LspBox *box);
 
-void lsp_free_val(LspValue v);
+/** Whether the integer `v` fits in an int64, which is then stored in `n`. */
+bool lsp_get_int64(LspValue v, int64_t n[static 1]);
 
-void lsp_replace_val(LspValue *self, LspValue *with);
-
-void lsp_exchange_val(LspValue *self, LspValue *with);
+uint8_t lsp_get_fn(LspValue v);
 
-LspValue lsp_copy_val(LspValue *self);
+void lsp_print_val(LspValue v);
 
 bool lsp_val_to_bool(LspValue self);